@@ -0,0 +1,367 @@
+// Regression checks for cache-layer edge cases that once crashed, hung or
+// misbehaved. Builds the server source with its main() renamed, so the
+// engines are exercised exactly as compiled into kvserver; best run under
+// AddressSanitizer.
+//
+// Usage: ./cachecheck     (exit status 0 when every check passes)
+#define main kvserver_main
+#include "kvserver.cpp"
+#undef main
+
+#include <sys/resource.h>
+#include <csignal>
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+    cout << (ok ? "ok     " : "FAILED ") << what << "\n";
+    if (!ok) failures++;
+}
+
+// on_hit moved probation nodes to protected without shrinking the pending
+// window-candidate run, so a later shrink walked past the end of probation
+static void tinylfu_shrink_after_hits() {
+    TinyLFUCache c(80000);      // window holds all six small entries
+    for (int i = 0; i < 6; i++) c.put("k" + to_string(i), "v");
+    c.put("big", string(800, 'x'));
+    string v;
+    for (int i = 0; i < 4; i++) c.get("k" + to_string(i), v);
+    c.set_capacity(1000);
+    c.set_capacity(200);
+    check(c.stats().bytes <= 200, "tinylfu: shrink after probation hits");
+}
+
+// a fetch that threw left its call pending, so later readers of the key
+// waited forever
+static void singleflight_throwing_fetch() {
+    SingleFlight flight(1);
+    thread leader([&] {
+        string v;
+        try {
+            flight.run("k", v, [](string&) -> DbResult {
+                this_thread::sleep_for(chrono::milliseconds(50));
+                throw bad_alloc();
+            });
+        } catch (const bad_alloc&) {}
+    });
+    this_thread::sleep_for(chrono::milliseconds(10));
+    string v;
+    DbResult joined = flight.run("k", v, [](string&) { return DB_NOT_FOUND; });
+    leader.join();
+    DbResult fresh = flight.run("k", v, [](string&) { return DB_NOT_FOUND; });
+    check(joined == DB_ERROR && fresh == DB_NOT_FOUND && flight.inflight() == 0,
+          "singleflight: throwing fetch releases waiters");
+}
+
+// lock-free readers race writers that overwrite, insert (growing the bucket
+// array from 64 heads many times over) and remove; a reader must never see
+// another key's value or miss a key that is always present, and ASan
+// catches any entry or table freed while a reader could still hold it
+static void epoch_concurrent_stress() {
+    const int STABLE = 1000, WRITERS = 2, READERS = 4, CHURN = 40000;
+    EpochLRUCache c(size_t(1) << 30);
+    for (int i = 0; i < STABLE; i++) c.put("s" + to_string(i), "s" + to_string(i) + "=0");
+
+    atomic<bool> writing{true};
+    atomic<int> bad_reads{0}, lost{0};
+    vector<thread> readers;
+    for (int r = 0; r < READERS; r++) {
+        readers.emplace_back([&, r] {
+            mt19937 rng(r);
+            string v;
+            while (writing.load()) {
+                string key = "s" + to_string(rng() % STABLE);
+                if (!c.get(key, v)) lost++;
+                else if (v.compare(0, key.size() + 1, key + "=") != 0) bad_reads++;
+                key = "c" + to_string(rng() % WRITERS) + "_" + to_string(rng() % CHURN);
+                if (c.get(key, v) && v.compare(0, key.size() + 1, key + "=") != 0) bad_reads++;
+            }
+        });
+    }
+    vector<thread> writers;
+    for (int w = 0; w < WRITERS; w++) {
+        writers.emplace_back([&, w] {
+            for (int i = 0; i < CHURN; i++) {
+                string key = "c" + to_string(w) + "_" + to_string(i);
+                c.put(key, key + "=" + string(i % 64, 'x'));
+                if (i % 3 == 0) c.remove("c" + to_string(w) + "_" + to_string(i / 2));
+                string stable = "s" + to_string(i % STABLE);
+                c.put(stable, stable + "=" + to_string(i));
+            }
+        });
+    }
+    for (auto& t : writers) t.join();
+    writing = false;
+    for (auto& t : readers) t.join();
+
+    // each writer removed the keys i / 2 for every third i
+    set<int> removed;
+    for (int i = 0; i < CHURN; i += 3) removed.insert(i / 2);
+    size_t expected = STABLE + WRITERS * (CHURN - removed.size());
+    CacheStats st = c.stats();
+    check(bad_reads == 0 && lost == 0 && st.entries == expected,
+          "lru-epoch: concurrent get/put/remove/grow");
+    c.set_capacity(0);
+    st = c.stats();
+    check(st.entries == 0 && st.bytes == 0, "lru-epoch: shrink to empty after stress");
+}
+
+// Journal checks run without Postgres: the flusher sleeps for an hour, so
+// every change stays dirty. Journals are leaked because their writer and
+// flusher threads are detached and never stop.
+static const chrono::hours NO_FLUSH(1);
+
+// one record in the on-disk format WriteBackJournal writes
+static string journal_record(WriteBackJournal::Op op, uint64_t lsn, int key,
+                             int64_t expires_ms, const string& value) {
+    string payload(1, (char)op);
+    payload.append((const char*)&lsn, 8);
+    payload.append((const char*)&key, 4);
+    payload.append((const char*)&expires_ms, 8);
+    payload.append(value);
+    uint32_t len = payload.size();
+    uint32_t crc = crc32(0L, (const Bytef*)payload.data(), payload.size());
+    string out((const char*)&len, 4);
+    out.append((const char*)&crc, 4);
+    return out + payload;
+}
+
+static void write_file(const string& path, const string& data) {
+    ofstream(path, ios::binary) << data;
+}
+
+static size_t file_size(const string& path) {
+    ifstream in(path, ios::binary | ios::ate);
+    return in ? (size_t)in.tellg() : 0;
+}
+
+static vector<string> journal_dirs;
+
+// a fresh directory for one journal; returns its base path
+static string journal_dir() {
+    char tmpl[] = "/tmp/cachecheck.XXXXXX";
+    journal_dirs.push_back(mkdtemp(tmpl));
+    return journal_dirs.back() + "/journal";
+}
+
+static void remove_journal_dirs() {
+    for (auto& dir : journal_dirs) {
+        if (DIR* d = opendir(dir.c_str())) {
+            while (dirent* e = readdir(d))
+                if (e->d_name[0] != '.') unlink((dir + "/" + e->d_name).c_str());
+            closedir(d);
+        }
+        rmdir(dir.c_str());
+    }
+}
+
+// records from every segment are replayed, an older lsn never overwriting
+// a newer one even when it sits in a later segment
+static void journal_replay_segments() {
+    string base = journal_dir();
+    write_file(base + ".000001",
+               journal_record(WriteBackJournal::PUT, 1, 1, 0, "a") +
+               journal_record(WriteBackJournal::PUT, 4, 2, 0, "new") +
+               journal_record(WriteBackJournal::PUT, 2, 3, 0, "c"));
+    write_file(base + ".000002",
+               journal_record(WriteBackJournal::PUT, 3, 2, 0, "old") +
+               journal_record(WriteBackJournal::PUT, 5, 1, 12345, "b") +
+               journal_record(WriteBackJournal::DEL, 6, 3, 0, ""));
+    auto* j = new WriteBackJournal(base, 100, NO_FLUSH);
+    bool started = j->start();
+    string v1, v2, v3;
+    int64_t e1 = 0, e2 = 0, e3 = 0;
+    check(started && j->lookup(1, v1, e1) == WriteBackJournal::DIRTY_PUT && v1 == "b" && e1 == 12345,
+          "journal: replays records across segments");
+    check(j->lookup(2, v2, e2) == WriteBackJournal::DIRTY_PUT && v2 == "new",
+          "journal: newest lsn wins over a later segment's older one");
+    check(j->lookup(3, v3, e3) == WriteBackJournal::DIRTY_DELETE,
+          "journal: replayed delete stays dirty");
+
+    // appends continue after the highest replayed lsn, in a new segment
+    bool appended = j->append(WriteBackJournal::PUT, 2, "newest", 0);
+    json st = j->stats();
+    check(appended && j->lookup(2, v2, e2) == WriteBackJournal::DIRTY_PUT && v2 == "newest" &&
+          st["durable_lsn"] == 7 && st["segments"] == 3 && file_size(base + ".000003") > 0,
+          "journal: appends after replay take the next lsn");
+}
+
+// replay stops at a torn or corrupt record and truncates the segment there,
+// so the next append isn't stranded behind garbage
+static void journal_truncates_bad_tail() {
+    string good = journal_record(WriteBackJournal::PUT, 1, 1, 0, "a") +
+                  journal_record(WriteBackJournal::PUT, 2, 2, 0, "b");
+
+    string torn = journal_record(WriteBackJournal::PUT, 3, 3, 0, "torn");
+    string base = journal_dir();
+    write_file(base + ".000001", good + torn.substr(0, torn.size() - 2));
+    auto* j = new WriteBackJournal(base, 100, NO_FLUSH);
+    string v;
+    int64_t e = 0;
+    check(j->start() && file_size(base + ".000001") == good.size() &&
+          j->lookup(2, v, e) == WriteBackJournal::DIRTY_PUT && v == "b" &&
+          j->lookup(3, v, e) == WriteBackJournal::CLEAN,
+          "journal: torn tail truncated on replay");
+
+    string bad = journal_record(WriteBackJournal::PUT, 3, 3, 0, "bad");
+    bad.back() ^= 0x5a;
+    string corrupt = bad + journal_record(WriteBackJournal::PUT, 4, 4, 0, "after");
+    base = journal_dir();
+    write_file(base + ".000001", good + corrupt);
+    j = new WriteBackJournal(base, 100, NO_FLUSH);
+    check(j->start() && file_size(base + ".000001") == good.size() &&
+          j->lookup(3, v, e) == WriteBackJournal::CLEAN &&
+          j->lookup(4, v, e) == WriteBackJournal::CLEAN,
+          "journal: replay stops at a crc mismatch");
+}
+
+// reads must see acknowledged writes before the flusher sends them to the DB
+static void journal_lookup_before_flush() {
+    auto* j = new WriteBackJournal(journal_dir(), 100, NO_FLUSH);
+    bool ok = j->start() &&
+              j->append(WriteBackJournal::PUT, 1, "v1", 0) &&
+              j->append(WriteBackJournal::PUT, 2, "v2", 777) &&
+              j->append(WriteBackJournal::DEL, 2, "", 0);
+    string v;
+    int64_t e = 0;
+    check(ok && j->lookup(1, v, e) == WriteBackJournal::DIRTY_PUT && v == "v1" && e == 0,
+          "journal: lookup returns an unflushed put");
+    check(j->lookup(2, v, e) == WriteBackJournal::DIRTY_DELETE &&
+          j->lookup(3, v, e) == WriteBackJournal::CLEAN,
+          "journal: lookup returns an unflushed delete");
+}
+
+// once a write fails nothing is acknowledged, since it might not be durable
+static void journal_rejects_after_failure() {
+    string base = journal_dir();
+    auto* j = new WriteBackJournal(base, 100, NO_FLUSH);
+    bool started = j->start();
+
+    // a file size limit makes the writer's write() fail with EFBIG; it also
+    // applies to stdout and stderr when redirected to files, so flush first
+    // and clear the error state their writes may leave behind
+    cout.flush();
+    rlimit old_limit;
+    getrlimit(RLIMIT_FSIZE, &old_limit);
+    auto old_handler = signal(SIGXFSZ, SIG_IGN);
+    rlimit limit = old_limit;
+    limit.rlim_cur = 16;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    bool first = j->append(WriteBackJournal::PUT, 1, string(64, 'x'), 0);
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    signal(SIGXFSZ, old_handler);
+    cout.clear();
+    cerr.clear();
+
+    bool second = j->append(WriteBackJournal::PUT, 2, "small", 0);
+    string v;
+    int64_t e = 0;
+    check(started && !first && !second && j->stats()["failed"] == true &&
+          j->lookup(1, v, e) == WriteBackJournal::CLEAN,
+          "journal: writes rejected after a failed write");
+}
+
+// Timer wheel checks step the wheel by hand: with hour-long ticks, wall
+// time never reaches the first tick while they run.
+static const chrono::hours TICK(1);
+static const int64_t TICK_MS = chrono::milliseconds(TICK).count();
+
+// steps w one tick at a time up to last, recording when each key fires
+static map<string, vector<uint64_t>> fire_ticks(TimerWheel& w, uint64_t last) {
+    map<string, vector<uint64_t>> fired;
+    for (uint64_t t = 1; t <= last; t++)
+        for (auto& key : w.advance_to(t)) fired[key].push_back(t);
+    return fired;
+}
+
+// timers past level 0 (256 ticks) and level 1 (65536 ticks) fire on their
+// tick after cascading down, not a slot early or late
+static void timerwheel_cascades() {
+    TimerWheel w(TICK);
+    vector<uint64_t> delays = {1, 255, 256, 257, 300, 511, 512, 65535, 65536, 65537, 70000, 131072};
+    for (uint64_t d : delays) w.schedule("t" + to_string(d), d * TICK_MS);
+    auto fired = fire_ticks(w, 140000);
+    bool exact = fired.size() == delays.size();
+    for (uint64_t d : delays)
+        exact = exact && fired["t" + to_string(d)] == vector<uint64_t>{d};
+    check(exact && w.size() == 0, "timerwheel: fires on time across level cascades");
+}
+
+// a cancelled timer never fires, and rescheduling a key keeps only the
+// latest deadline, whether it moved earlier or later
+static void timerwheel_cancel_reschedule() {
+    TimerWheel w(TICK);
+    w.schedule("cancelled", 300 * TICK_MS);
+    w.schedule("later", 10 * TICK_MS);
+    w.schedule("earlier", 70000 * TICK_MS);
+    w.schedule("kept", 20 * TICK_MS);
+    w.cancel("cancelled");
+    w.schedule("later", 70000 * TICK_MS);
+    w.schedule("earlier", 10 * TICK_MS);
+    bool sized = w.size() == 3;
+    auto fired = fire_ticks(w, 80000);
+    check(sized && fired.size() == 3 && fired["later"] == vector<uint64_t>{70000} &&
+          fired["earlier"] == vector<uint64_t>{10} && fired["kept"] == vector<uint64_t>{20},
+          "timerwheel: cancel and reschedule");
+}
+
+// a row read back from the DB with its remaining lifetime in ms
+static PGresult* db_row(const string& value, const string* ttl_ms) {
+    PGresult* res = PQmakeEmptyPGresult(nullptr, PGRES_TUPLES_OK);
+    PGresAttDesc attrs[2] = {
+        {(char*)"value", 0, 0, PG_BINARY, PG_BYTEA, -1, -1},
+        {(char*)"ttl", 0, 0, PG_BINARY, PG_INT8, 8, -1}};
+    PQsetResultAttrs(res, 2, attrs);
+    PQsetvalue(res, 0, 0, (char*)value.data(), value.size());
+    PQsetvalue(res, 0, 1, ttl_ms ? (char*)ttl_ms->data() : nullptr, ttl_ms ? 8 : -1);
+    return res;
+}
+
+// entries filled on a miss expire with what was left of the row's TTL (or
+// the unflushed journal change's), not a fresh one, and rows without a TTL
+// never enter the wheel
+static void ttl_fill_inherits_remaining() {
+    cache = make_cache(ServerOptions());
+    negative_cache.reset(new NegativeCache(1, chrono::milliseconds(1000), 100));
+    expiry_wheel.reset(new TimerWheel(TICK));
+
+    string ttl = pg_int8(3 * TICK_MS - 1000);
+    string value;
+    int64_t ttl_ms = 0;
+    DbResult res = db_read_result(db_row("db", &ttl), value, &ttl_ms);
+    read_fill("from-db", 0, key_versions.get("from-db"), res, value, ttl_ms);
+    res = db_read_result(db_row("forever", nullptr), value, &ttl_ms);
+    read_fill("no-ttl", 0, key_versions.get("no-ttl"), res, value, ttl_ms);
+
+    write_back.reset(new WriteBackJournal(journal_dir(), 100, NO_FLUSH));
+    bool journaled = write_back->start() &&
+        write_back->append(WriteBackJournal::PUT, 7, "wb", epoch_ms() + 2 * TICK_MS - 1000);
+    DbResult local;
+    bool settled = read_local(7, "7", value, 0, key_versions.get("7"), local);
+
+    string cached;
+    bool filled = cache->get("from-db", cached) && cached == "db" &&
+                  cache->get("no-ttl", cached) && cached == "forever" &&
+                  settled && local == DB_OK && cache->get("7", cached) && cached == "wb";
+    bool scheduled = expiry_wheel->size() == 2;
+    auto fired = fire_ticks(*expiry_wheel, 5);
+    check(filled && journaled && scheduled && fired.size() == 2 &&
+          fired["from-db"] == vector<uint64_t>{3} && fired["7"] == vector<uint64_t>{2},
+          "ttl: filled entries inherit the remaining ttl");
+    write_back.release();       // its threads never stop
+}
+
+int main() {
+    tinylfu_shrink_after_hits();
+    singleflight_throwing_fetch();
+    epoch_concurrent_stress();
+    journal_replay_segments();
+    journal_truncates_bad_tail();
+    journal_lookup_before_flush();
+    journal_rejects_after_failure();
+    timerwheel_cascades();
+    timerwheel_cancel_reschedule();
+    ttl_fill_inherits_remaining();
+    remove_journal_dirs();
+    return failures ? 1 : 0;
+}
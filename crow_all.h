@@ -10858,6 +10858,9 @@ namespace crow
         /// Call the after handle middleware and send the write the response to the connection.
         void complete_request()
         {
+            // when res.end() runs after the handler returned, the completion
+            // handler reset below holds the last reference to this connection
+            auto self = this->shared_from_this();
             CROW_LOG_INFO << "Response: " << this << ' ' << req_.raw_url << ' ' << res.code << ' ' << close_connection_;
             res.is_alive_helper_ = nullptr;
 
@@ -0,0 +1,251 @@
+// Flat open-addressing hash index from string keys to small values
+// (Swiss-table layout).
+//
+// Slots live in one array next to an array of control bytes, one per slot:
+// EMPTY, DELETED, or the low 7 bits of the key's hash (H2) when full. A
+// lookup hashes once, picks a 16-slot group from the high bits (H1) and
+// compares all 16 control bytes against H2 with a single SSE2 compare, so
+// only slots whose tag matches are ever dereferenced. Probing moves to the
+// next group (triangular sequence) until a group containing an EMPTY byte
+// is reached. Keys of up to 12 bytes are stored inline in the slot; longer
+// keys go to a separately allocated buffer. Values should be trivially
+// copyable (pointers, indices).
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <functional>
+#include <string_view>
+#include <utility>
+#include <new>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+template <class V>
+class FlatIndex {
+    static const size_t GROUP = 16;
+    static const size_t INLINE_KEY = 12;
+    static const int8_t EMPTY = -128;      // 0b10000000
+    static const int8_t DELETED = -2;      // 0b11111110
+
+    // 4 + 12 bytes ahead of the value keeps the slot at 24 bytes for a
+    // pointer value; a long key keeps its buffer pointer in the key bytes
+    struct Slot {
+        uint32_t len;
+        char inline_key[INLINE_KEY];
+        V value;
+
+        char* heap_key() const {
+            char* p;
+            memcpy(&p, inline_key, sizeof(p));
+            return p;
+        }
+        void set_heap_key(char* p) { memcpy(inline_key, &p, sizeof(p)); }
+        const char* key_data() const { return len <= INLINE_KEY ? inline_key : heap_key(); }
+        std::string_view key() const { return std::string_view(key_data(), len); }
+    };
+
+    int8_t* ctrl = nullptr;     // capacity bytes, 16-byte aligned
+    Slot* slots = nullptr;
+    size_t capacity = 0;        // power of two, multiple of GROUP
+    size_t count = 0;
+    size_t tombstones = 0;
+
+    static size_t hash_of(std::string_view k) {
+        size_t h = std::hash<std::string_view>{}(k);
+        // spread the bits so both H1 (group) and H2 (tag) are well mixed
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return h;
+    }
+    static int8_t h2(size_t h) { return (int8_t)(h & 0x7F); }
+    static size_t h1(size_t h) { return h >> 7; }
+
+    // bitmask of positions in the group whose control byte equals b
+    static uint32_t match(const int8_t* group, int8_t b) {
+#if defined(__SSE2__)
+        __m128i ctrl_bytes = _mm_load_si128((const __m128i*)group);
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(b), ctrl_bytes));
+#else
+        uint32_t m = 0;
+        for (size_t i = 0; i < GROUP; i++)
+            if (group[i] == b) m |= 1u << i;
+        return m;
+#endif
+    }
+
+    // bitmask of EMPTY or DELETED positions (the only bytes with bit 7 set)
+    static uint32_t match_free(const int8_t* group) {
+#if defined(__SSE2__)
+        return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i*)group));
+#else
+        uint32_t m = 0;
+        for (size_t i = 0; i < GROUP; i++)
+            if (group[i] < 0) m |= 1u << i;
+        return m;
+#endif
+    }
+
+    size_t groups() const { return capacity / GROUP; }
+
+    // index of the slot holding k, or SIZE_MAX
+    size_t find_index(std::string_view k, size_t h) const {
+        if (!capacity) return SIZE_MAX;
+        size_t mask = groups() - 1;
+        size_t g = h1(h) & mask;
+        for (size_t step = 1;; step++) {
+            const int8_t* group = ctrl + g * GROUP;
+            for (uint32_t m = match(group, h2(h)); m; m &= m - 1) {
+                size_t i = g * GROUP + __builtin_ctz(m);
+                if (slots[i].len == k.size() &&
+                    memcmp(slots[i].key_data(), k.data(), k.size()) == 0)
+                    return i;
+            }
+            if (match(group, EMPTY)) return SIZE_MAX;
+            g = (g + step) & mask;
+        }
+    }
+
+    // first EMPTY or DELETED slot on k's probe sequence
+    size_t find_free(size_t h) const {
+        size_t mask = groups() - 1;
+        size_t g = h1(h) & mask;
+        for (size_t step = 1;; step++) {
+            uint32_t m = match_free(ctrl + g * GROUP);
+            if (m) return g * GROUP + __builtin_ctz(m);
+            g = (g + step) & mask;
+        }
+    }
+
+    void allocate(size_t cap) {
+        capacity = cap;
+        ctrl = static_cast<int8_t*>(aligned_alloc(GROUP, cap));
+        slots = static_cast<Slot*>(malloc(cap * sizeof(Slot)));
+        if (!ctrl || !slots) throw std::bad_alloc();
+        memset(ctrl, EMPTY, cap);
+        count = 0;
+        tombstones = 0;
+    }
+
+    void rehash(size_t new_cap) {
+        int8_t* old_ctrl = ctrl;
+        Slot* old_slots = slots;
+        size_t old_cap = capacity;
+        allocate(new_cap);
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old_ctrl[i] < 0) continue;
+            size_t h = hash_of(old_slots[i].key());
+            size_t j = find_free(h);
+            ctrl[j] = h2(h);
+            memcpy(static_cast<void*>(&slots[j]), &old_slots[i], sizeof(Slot));   // moves heap keys too
+            count++;
+        }
+        free(old_ctrl);
+        free(old_slots);
+    }
+
+    // keep full + deleted slots under 7/8 of the table
+    void reserve_one() {
+        if (!capacity) { allocate(GROUP); return; }
+        if ((count + tombstones + 1) * 8 <= capacity * 7) return;
+        // mostly tombstones: rebuild in place size, otherwise grow
+        rehash(count * 2 < capacity ? capacity : capacity * 2);
+    }
+
+    void release_key(Slot& s) {
+        if (s.len > INLINE_KEY) free(s.heap_key());
+    }
+
+public:
+    FlatIndex() {}
+    ~FlatIndex() { clear(); }
+    FlatIndex(const FlatIndex&) = delete;
+    FlatIndex& operator=(const FlatIndex&) = delete;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    V* find(std::string_view k) {
+        size_t i = find_index(k, hash_of(k));
+        return i == SIZE_MAX ? nullptr : &slots[i].value;
+    }
+    const V* find(std::string_view k) const {
+        size_t i = find_index(k, hash_of(k));
+        return i == SIZE_MAX ? nullptr : &slots[i].value;
+    }
+
+    // inserts k -> v unless k is present; returns the value slot and
+    // whether an insertion happened
+    std::pair<V*, bool> insert(std::string_view k, const V& v) {
+        size_t h = hash_of(k);
+        size_t i = find_index(k, h);
+        if (i != SIZE_MAX) return {&slots[i].value, false};
+
+        reserve_one();
+        i = find_free(h);
+        if (ctrl[i] == DELETED) tombstones--;
+        ctrl[i] = h2(h);
+        Slot& s = slots[i];
+        s.len = k.size();
+        if (k.size() <= INLINE_KEY) {
+            memcpy(s.inline_key, k.data(), k.size());
+        } else {
+            char* buf = static_cast<char*>(malloc(k.size()));
+            if (!buf) throw std::bad_alloc();
+            memcpy(buf, k.data(), k.size());
+            s.set_heap_key(buf);
+        }
+        s.value = v;
+        count++;
+        return {&s.value, true};
+    }
+
+    bool erase(std::string_view k) {
+        size_t i = find_index(k, hash_of(k));
+        if (i == SIZE_MAX) return false;
+        release_key(slots[i]);
+        // lookups already stop at a group with an EMPTY byte, so the slot
+        // can go back to EMPTY there; otherwise leave a tombstone
+        const int8_t* group = ctrl + (i & ~(GROUP - 1));
+        if (match(group, EMPTY)) {
+            ctrl[i] = EMPTY;
+        } else {
+            ctrl[i] = DELETED;
+            tombstones++;
+        }
+        count--;
+        return true;
+    }
+
+    template <class F>
+    void for_each(F f) const {
+        for (size_t i = 0; i < capacity; i++)
+            if (ctrl[i] >= 0) f(slots[i].key(), slots[i].value);
+    }
+
+    void clear() {
+        for (size_t i = 0; i < capacity; i++)
+            if (ctrl[i] >= 0) release_key(slots[i]);
+        free(ctrl);
+        free(slots);
+        ctrl = nullptr;
+        slots = nullptr;
+        capacity = count = tombstones = 0;
+    }
+
+    // bytes held by the table, including out-of-line keys
+    size_t memory_bytes() const {
+        size_t bytes = capacity * (sizeof(Slot) + 1);
+        for (size_t i = 0; i < capacity; i++)
+            if (ctrl[i] >= 0 && slots[i].len > INLINE_KEY) bytes += slots[i].len;
+        return bytes;
+    }
+
+    // table bytes per entry in a full table: load stays between 7/16 (just
+    // after doubling) and 7/8, so this bounds the per-entry share for budgeting
+    static constexpr size_t max_bytes_per_entry() { return (sizeof(Slot) + 1) * 16 / 7 + 1; }
+};
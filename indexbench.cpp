@@ -0,0 +1,112 @@
+// Microbenchmark: cache index lookups, FlatIndex vs the node-based
+// unordered_map<string, list<...>::iterator> the LRU cache used before.
+//
+// Usage: ./indexbench [num_entries] [num_lookups]
+#include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include "flat_index.hpp"
+
+using namespace std;
+
+// counts bytes handed out to the unordered_map (nodes and buckets)
+static size_t allocated_bytes = 0;
+
+template <class T>
+struct CountingAllocator {
+    typedef T value_type;
+    CountingAllocator() {}
+    template <class U> CountingAllocator(const CountingAllocator<U>&) {}
+    T* allocate(size_t n) {
+        allocated_bytes += n * sizeof(T);
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+        allocated_bytes -= n * sizeof(T);
+        ::operator delete(p);
+    }
+    template <class U> bool operator==(const CountingAllocator<U>&) const { return true; }
+    template <class U> bool operator!=(const CountingAllocator<U>&) const { return false; }
+};
+
+typedef list<pair<string, string>>::iterator ListIter;
+typedef unordered_map<string, ListIter, hash<string>, equal_to<string>,
+                      CountingAllocator<pair<const string, ListIter>>> NodeMap;
+
+static double seconds_since(chrono::steady_clock::time_point t0) {
+    return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+// heap bytes of a key beyond the string object itself
+static size_t key_heap_bytes(const string& s) {
+    return s.capacity() > string().capacity() ? s.capacity() + 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    size_t n = argc > 1 ? stoull(argv[1]) : 2000000;
+    size_t lookups = argc > 2 ? stoull(argv[2]) : 10000000;
+
+    vector<string> keys, missing;
+    for (size_t i = 0; i < n; i++) keys.push_back(to_string(i * 2 + 1));
+    for (size_t i = 0; i < n; i++) missing.push_back(to_string(i * 2 + 2));
+    mt19937_64 gen(42);
+    shuffle(keys.begin(), keys.end(), gen);
+
+    vector<size_t> order(lookups);
+    for (auto& o : order) o = gen() % n;
+
+    cout << "entries = " << n << ", lookups = " << lookups << "\n\n";
+
+    // node-based map
+    {
+        list<pair<string, string>> lru;
+        lru.push_back({"", ""});
+        NodeMap map;
+        auto t0 = chrono::steady_clock::now();
+        for (auto& k : keys) map.emplace(k, lru.begin());
+        double insert_s = seconds_since(t0);
+
+        size_t found = 0;
+        t0 = chrono::steady_clock::now();
+        for (size_t i : order) found += map.find(keys[i]) != map.end();
+        double hit_s = seconds_since(t0);
+
+        t0 = chrono::steady_clock::now();
+        for (size_t i : order) found += map.find(missing[i]) != map.end();
+        double miss_s = seconds_since(t0);
+
+        size_t bytes = allocated_bytes;
+        for (auto& kv : map) bytes += key_heap_bytes(kv.first);
+        cout << "unordered_map: insert " << n / insert_s / 1e6 << " M/s, hit lookups "
+             << lookups / hit_s / 1e6 << " M/s, miss lookups " << lookups / miss_s / 1e6
+             << " M/s, " << (double)bytes / n << " bytes/entry (found " << found << ")\n";
+    }
+
+    // flat index
+    {
+        FlatIndex<void*> index;
+        auto t0 = chrono::steady_clock::now();
+        for (auto& k : keys) index.insert(k, nullptr);
+        double insert_s = seconds_since(t0);
+
+        size_t found = 0;
+        t0 = chrono::steady_clock::now();
+        for (size_t i : order) found += index.find(keys[i]) != nullptr;
+        double hit_s = seconds_since(t0);
+
+        t0 = chrono::steady_clock::now();
+        for (size_t i : order) found += index.find(missing[i]) != nullptr;
+        double miss_s = seconds_since(t0);
+
+        cout << "FlatIndex:     insert " << n / insert_s / 1e6 << " M/s, hit lookups "
+             << lookups / hit_s / 1e6 << " M/s, miss lookups " << lookups / miss_s / 1e6
+             << " M/s, " << (double)index.memory_bytes() / n << " bytes/entry (found "
+             << found << ")\n";
+    }
+    return 0;
+}
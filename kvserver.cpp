@@ -1,307 +1,5090 @@
 #include "crow_all.h"
 #include "json.hpp"
+#include "flat_index.hpp"
 #include <iostream>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <atomic>
 #include <unordered_map>
+#include <unordered_set>
 #include <list>
+#include <map>
+#include <deque>
+#include <algorithm>
 #include <string>
+#include <string_view>
 #include <chrono>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <tuple>
+#include <fstream>
+#include <random>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <endian.h>
+#include <zlib.h>
 #include <libpq-fe.h>
 
 using namespace std;
 using json = nlohmann::json;
 
-// LRU Cache Implementation
-class LRUCache {
-    int capacity;
-    list<pair<string, string>> kvcache;
-    unordered_map<string, list<pair<string, string>>::iterator> kvmap;
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;           // live bytes charged against the budget
+    size_t capacity_bytes = 0;
+};
+
+// Receives entries as an engine evicts them (under the shard lock, so it
+// must be quick); used to spill them to the flash tier
+typedef function<void(const string& key, const string& value)> EvictionSink;
+
+// Heap bytes owned by a string beyond sizeof(string) (0 while it fits in SSO)
+static inline size_t string_heap_bytes(const string& s) {
+    static const size_t sso_capacity = string().capacity();
+    return s.capacity() > sso_capacity ? s.capacity() + 1 : 0;
+}
+
+// Hash for an engine's own bucket index. ShardedCache picks the shard from
+// the low bits of the same std::hash, so all keys of a shard share them;
+// the bits are mixed so a power-of-two bucket mask still spreads them.
+static inline size_t index_hash(const string& key) {
+    size_t h = hash<string>{}(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+// Per-entry bookkeeping of a node-based hash index: node (next pointer,
+// key, mapped value, cached hash) plus its share of the bucket array
+template <class Key, class Mapped>
+constexpr size_t index_node_bytes() {
+    return sizeof(void*) + sizeof(Key) + sizeof(Mapped) + sizeof(size_t) + sizeof(void*);
+}
+
+// Policy-based cache: PolicyCache owns the entries, the index and the byte
+// accounting, while the eviction policy only orders entries through the
+// intrusive hooks in CacheNode. The policy is a template parameter, so its
+// hooks are inlined into the cache with no virtual dispatch. A policy
+// provides:
+//   Policy(size_t capacity_bytes)
+//   void on_insert(CacheNode*)        new entry became resident
+//   void on_hit(CacheNode*)           lookup hit
+//   void on_miss(const string& key)   lookup miss
+//   void on_update(CacheNode*, size_t old_charge)   value replaced
+//   void on_remove(CacheNode*)        explicit removal (not an eviction)
+//   CacheNode* victim()               unlink and return the next entry to evict
+//   void set_capacity(size_t bytes)   budget changed; the cache evicts to fit
+//   void hottest(vector<string>&, size_t limit) const   keys, hottest first
+struct CacheNode {
+    string key;
+    string value;
+    uint64_t hash;
+    size_t charge;
+    CacheNode* prev = nullptr;
+    CacheNode* next = nullptr;
+    uint8_t seg = 0;            // which of the policy's lists holds the node
+};
+
+// Intrusive doubly-linked list of CacheNodes, front = most recently used
+struct NodeList {
+    CacheNode* head = nullptr;
+    CacheNode* tail = nullptr;
+    size_t count = 0;
+    size_t bytes = 0;
+
+    bool empty() const { return head == nullptr; }
+
+    void push_front(CacheNode* n) {
+        n->prev = nullptr;
+        n->next = head;
+        if (head) head->prev = n; else tail = n;
+        head = n;
+        count++;
+        bytes += n->charge;
+    }
+
+    void unlink(CacheNode* n) {
+        if (n->prev) n->prev->next = n->next; else head = n->next;
+        if (n->next) n->next->prev = n->prev; else tail = n->prev;
+        n->prev = n->next = nullptr;
+        count--;
+        bytes -= n->charge;
+    }
+
+    CacheNode* pop_back() {
+        CacheNode* n = tail;
+        if (n) unlink(n);
+        return n;
+    }
+
+    void move_to_front(CacheNode* n) {
+        if (head == n) return;
+        unlink(n);
+        push_front(n);
+    }
+
+    void collect(vector<string>& out, size_t limit) const {
+        for (CacheNode* n = head; n && out.size() < limit; n = n->next) out.push_back(n->key);
+    }
+};
+
+// Plain LRU: one recency list, evict from the tail
+struct LRUPolicy {
+    NodeList lru;
+
+    LRUPolicy(size_t) {}
+    void set_capacity(size_t) {}
+    void on_insert(CacheNode* n) { lru.push_front(n); }
+    void on_hit(CacheNode* n) { lru.move_to_front(n); }
+    void on_miss(const string&) {}
+    void on_update(CacheNode* n, size_t old_charge) {
+        lru.bytes += n->charge - old_charge;
+        lru.move_to_front(n);
+    }
+    void on_remove(CacheNode* n) { lru.unlink(n); }
+    CacheNode* victim() { return lru.pop_back(); }
+    void hottest(vector<string>& out, size_t limit) const { lru.collect(out, limit); }
+};
+
+// Segmented LRU: new entries go to probation and are promoted to the
+// protected segment (80% of the budget) on their second access; protected
+// overflow is demoted back to probation, which is evicted first
+struct SLRUPolicy {
+    enum { PROBATION, PROTECTED };
+    NodeList segs[2];
+    size_t protected_cap;
+
+    SLRUPolicy(size_t cap_bytes) : protected_cap(cap_bytes * 8 / 10) {}
+
+    // protected overflow is demoted on the next promotion
+    void set_capacity(size_t cap_bytes) { protected_cap = cap_bytes * 8 / 10; }
+
+    void on_insert(CacheNode* n) {
+        n->seg = PROBATION;
+        segs[PROBATION].push_front(n);
+    }
+
+    void on_hit(CacheNode* n) {
+        if (n->seg == PROTECTED) {
+            segs[PROTECTED].move_to_front(n);
+            return;
+        }
+        segs[PROBATION].unlink(n);
+        n->seg = PROTECTED;
+        segs[PROTECTED].push_front(n);
+        while (segs[PROTECTED].bytes > protected_cap && segs[PROTECTED].count > 1) {
+            CacheNode* d = segs[PROTECTED].pop_back();
+            d->seg = PROBATION;
+            segs[PROBATION].push_front(d);
+        }
+    }
+
+    void on_miss(const string&) {}
+
+    void on_update(CacheNode* n, size_t old_charge) {
+        segs[n->seg].bytes += n->charge - old_charge;
+        on_hit(n);
+    }
+
+    void on_remove(CacheNode* n) { segs[n->seg].unlink(n); }
+
+    CacheNode* victim() {
+        if (!segs[PROBATION].empty()) return segs[PROBATION].pop_back();
+        return segs[PROTECTED].pop_back();
+    }
+
+    void hottest(vector<string>& out, size_t limit) const {
+        segs[PROTECTED].collect(out, limit);
+        segs[PROBATION].collect(out, limit);
+    }
+};
+
+// Adaptive Replacement Cache: T1 holds entries seen once recently, T2
+// entries seen at least twice. Ghost lists B1/B2 remember the hashes of
+// recent evictions from each, and a hit on a ghost shifts the target size
+// p of T1 toward the list that would have kept the entry. Sizes are in
+// bytes; ghosts are bounded to the cache budget worth of evicted charge.
+class ARCPolicy {
+    enum { T1, T2 };
+
+    struct Ghosts {
+        list<pair<uint64_t, size_t>> order;     // (hash, charge), front = newest
+        unordered_map<uint64_t, list<pair<uint64_t, size_t>>::iterator> index;
+        size_t bytes = 0;
+
+        void push(uint64_t h, size_t charge) {
+            erase(h);
+            order.push_front({h, charge});
+            index[h] = order.begin();
+            bytes += charge;
+        }
+        bool erase(uint64_t h) {
+            auto it = index.find(h);
+            if (it == index.end()) return false;
+            bytes -= it->second->second;
+            order.erase(it->second);
+            index.erase(it);
+            return true;
+        }
+        void pop_back() {
+            bytes -= order.back().second;
+            index.erase(order.back().first);
+            order.pop_back();
+        }
+    };
+
+    NodeList t[2];
+    Ghosts b1, b2;
+    size_t capacity;
+    size_t p = 0;               // target bytes for T1
+
+    void trim_ghosts() {
+        while (b1.bytes + b2.bytes > capacity) {
+            if (b1.bytes >= b2.bytes && !b1.order.empty()) b1.pop_back();
+            else if (!b2.order.empty()) b2.pop_back();
+            else b1.pop_back();
+        }
+    }
+
+public:
+    ARCPolicy(size_t cap_bytes) : capacity(cap_bytes) {}
+
+    void set_capacity(size_t cap_bytes) {
+        capacity = cap_bytes;
+        p = min(p, capacity);
+        trim_ghosts();
+    }
+
+    void on_insert(CacheNode* n) {
+        size_t nb1 = b1.order.size(), nb2 = b2.order.size();
+        if (b1.erase(n->hash)) {
+            size_t delta = n->charge * max<size_t>(1, nb2 / max<size_t>(nb1, 1));
+            p = min(capacity, p + delta);
+            n->seg = T2;
+        } else if (b2.erase(n->hash)) {
+            size_t delta = n->charge * max<size_t>(1, nb1 / max<size_t>(nb2, 1));
+            p = p > delta ? p - delta : 0;
+            n->seg = T2;
+        } else {
+            n->seg = T1;
+        }
+        t[n->seg].push_front(n);
+    }
+
+    void on_hit(CacheNode* n) {
+        t[n->seg].unlink(n);
+        n->seg = T2;
+        t[T2].push_front(n);
+    }
+
+    void on_miss(const string&) {}
+
+    void on_update(CacheNode* n, size_t old_charge) {
+        t[n->seg].bytes += n->charge - old_charge;
+        on_hit(n);
+    }
+
+    void on_remove(CacheNode* n) { t[n->seg].unlink(n); }
+
+    CacheNode* victim() {
+        CacheNode* n;
+        if (!t[T1].empty() && (t[T1].bytes > p || t[T2].empty())) {
+            n = t[T1].pop_back();
+            b1.push(n->hash, n->charge);
+        } else {
+            n = t[T2].pop_back();
+            if (n) b2.push(n->hash, n->charge);
+        }
+        trim_ghosts();
+        return n;
+    }
+
+    void hottest(vector<string>& out, size_t limit) const {
+        t[T2].collect(out, limit);
+        t[T1].collect(out, limit);
+    }
+};
+
+// Count-min sketch of access frequencies with 4-bit counters. After
+// sample_size increments every counter is halved, so the estimates follow
+// recent popularity instead of all-time counts.
+class FrequencySketch {
+    vector<uint64_t> table;     // 16 four-bit counters per word
+    size_t mask;
+    size_t additions = 0;
+    size_t sample_size;
+
+    static uint64_t mix(uint64_t h, uint64_t seed) {
+        h = (h + seed) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 32;
+        return h * 0xBF58476D1CE4E5B9ull;
+    }
+
+    size_t counter_index(uint64_t h, int row) const {
+        return mix(h, row * 0x632BE59BD9B4E019ull) & mask;
+    }
+
+    unsigned counter(size_t i) const { return (table[i >> 4] >> ((i & 15) * 4)) & 0xF; }
+
+public:
+    FrequencySketch(size_t expected_entries) {
+        size_t width = 64;
+        while (width < expected_entries) width <<= 1;
+        table.assign(width / 4, 0);    // 4 counters per entry
+        mask = width * 4 - 1;
+        sample_size = width * 10;
+    }
+
+    unsigned frequency(uint64_t h) const {
+        unsigned f = 15;
+        for (int r = 0; r < 4; r++) f = min(f, counter(counter_index(h, r)));
+        return f;
+    }
+
+    void increment(uint64_t h) {
+        bool added = false;
+        for (int r = 0; r < 4; r++) {
+            size_t i = counter_index(h, r);
+            if (counter(i) < 15) {
+                table[i >> 4] += 1ull << ((i & 15) * 4);
+                added = true;
+            }
+        }
+        if (added && ++additions >= sample_size) age();
+    }
+
+    void age() {
+        for (auto& w : table) w = (w >> 1) & 0x7777777777777777ull;
+        additions /= 2;
+    }
+};
+
+// W-TinyLFU: new entries enter a small LRU window (1% of the budget);
+// entries leaving the window must win a frequency duel against the
+// probation LRU victim to be admitted into the main segmented LRU
+// (probation + protected, 80% of main). One-hit wonders from scans are
+// rejected instead of flushing the frequently used working set.
+class TinyLFUPolicy {
+    enum { WINDOW, PROBATION, PROTECTED };
+
+    NodeList segs[3];
+    size_t window_cap, protected_cap;
+    // window overflow of the latest insert, at the MRU end of probation;
+    // only valid for that insert's evictions, so anything else that
+    // reorders or shrinks probation drops it
+    size_t candidates = 0;
+    FrequencySketch sketch;
+
+    void move_to(CacheNode* n, uint8_t seg) {
+        segs[n->seg].unlink(n);
+        n->seg = seg;
+        segs[seg].push_front(n);
+    }
+
+public:
+    TinyLFUPolicy(size_t cap_bytes) : sketch(max<size_t>(cap_bytes / 256, 64)) {
+        set_capacity(cap_bytes);
+    }
+
+    // segment overflow moves down on the next insert or hit; the sketch
+    // keeps its width
+    void set_capacity(size_t cap_bytes) {
+        candidates = 0;
+        window_cap = max<size_t>(cap_bytes / 100, 1);
+        protected_cap = (cap_bytes - min(cap_bytes, window_cap)) * 8 / 10;
+    }
+
+    void on_insert(CacheNode* n) {
+        n->seg = WINDOW;
+        segs[WINDOW].push_front(n);
+        candidates = 0;
+        while (segs[WINDOW].bytes > window_cap && segs[WINDOW].count > 1) {
+            move_to(segs[WINDOW].tail, PROBATION);
+            candidates++;
+        }
+    }
+
+    void on_hit(CacheNode* n) {
+        sketch.increment(n->hash);
+        if (n->seg == WINDOW) {
+            segs[WINDOW].move_to_front(n);
+            return;
+        }
+        candidates = 0;
+        move_to(n, PROTECTED);
+        while (segs[PROTECTED].bytes > protected_cap && segs[PROTECTED].count > 1)
+            move_to(segs[PROTECTED].tail, PROBATION);
+    }
+
+    void on_miss(const string& key) { sketch.increment(hash<string>{}(key)); }
+
+    void on_update(CacheNode* n, size_t old_charge) {
+        segs[n->seg].bytes += n->charge - old_charge;
+        candidates = 0;
+        if (n->seg == WINDOW) segs[WINDOW].move_to_front(n);
+        else move_to(n, PROTECTED);
+    }
+
+    void on_remove(CacheNode* n) {
+        if (n->seg != WINDOW) candidates = 0;
+        segs[n->seg].unlink(n);
+    }
+
+    CacheNode* victim() {
+        NodeList& probation = segs[PROBATION];
+        if (probation.empty()) {
+            candidates = 0;
+            if (!segs[PROTECTED].empty()) return segs[PROTECTED].pop_back();
+            return segs[WINDOW].pop_back();
+        }
+        CacheNode* v = probation.tail;
+        if (candidates == 0 || probation.count == 1) {
+            if (candidates) candidates--;
+            return probation.pop_back();
+        }
+        // oldest pending candidate sits `candidates` nodes from the front
+        candidates = min(candidates, probation.count);
+        CacheNode* c = probation.head;
+        for (size_t i = 1; i < candidates; i++) c = c->next;
+        candidates--;
+        CacheNode* loser = (c != v && sketch.frequency(c->hash) > sketch.frequency(v->hash)) ? v : c;
+        probation.unlink(loser);
+        return loser;
+    }
+
+    void hottest(vector<string>& out, size_t limit) const {
+        segs[PROTECTED].collect(out, limit);
+        segs[PROBATION].collect(out, limit);
+        segs[WINDOW].collect(out, limit);
+    }
+};
+
+// Cache Implementation over an eviction policy, bounded by a byte budget:
+// each entry is charged for its key and value (including their heap
+// buffers), its node and its index entry, and the policy's victims are
+// evicted until the total fits again. The index is a flat Swiss-style
+// table (flat_index.hpp) mapping keys to their nodes.
+template <class Policy>
+class PolicyCache {
+    static const size_t NODE_OVERHEAD = sizeof(CacheNode) + FlatIndex<CacheNode*>::max_bytes_per_entry();
+
+    size_t capacity;
+    size_t bytes = 0;
+    FlatIndex<CacheNode*> index;
+    Policy policy;
+    uint64_t hits = 0, misses = 0, evictions = 0;
+    EvictionSink on_evict;
+    mutable mutex mtx;
+
+    static size_t charge(const CacheNode* n) {
+        return NODE_OVERHEAD + string_heap_bytes(n->key) + string_heap_bytes(n->value);
+    }
+
+    void erase_node(CacheNode* n) {
+        bytes -= n->charge;
+        index.erase(n->key);
+        delete n;
+    }
+
+    void remove_locked(const string& key) {
+        CacheNode** found = index.find(key);
+        if (!found) return;
+        CacheNode* n = *found;
+        policy.on_remove(n);
+        erase_node(n);
+    }
+
+    void evict_to_fit() {
+        while (bytes > capacity) {
+            CacheNode* v = policy.victim();
+            if (!v) break;
+            if (on_evict) on_evict(v->key, v->value);
+            erase_node(v);
+            evictions++;
+        }
+    }
+
+public:
+    PolicyCache(size_t cap_bytes) : capacity(cap_bytes), policy(cap_bytes) {}
+
+    ~PolicyCache() {
+        index.for_each([](string_view, CacheNode* n) { delete n; });
+    }
+
+    PolicyCache(const PolicyCache&) = delete;
+    PolicyCache& operator=(const PolicyCache&) = delete;
+
+    void set_eviction_sink(EvictionSink sink) { on_evict = sink; }
+
+    void put(const string& key, const string& value) {
+        lock_guard<mutex> lock(mtx);
+        CacheNode** found = index.find(key);
+        if (found) {
+            CacheNode* n = *found;
+            size_t old_charge = n->charge;
+            n->value = value;
+            n->charge = charge(n);
+            bytes += n->charge - old_charge;
+            policy.on_update(n, old_charge);
+        } else {
+            CacheNode* n = new CacheNode;
+            n->key = key;
+            n->value = value;
+            n->hash = hash<string>{}(key);
+            n->charge = charge(n);
+            bytes += n->charge;
+            index.insert(n->key, n);
+            policy.on_insert(n);
+        }
+
+        // an entry larger than the whole budget ends up evicting itself
+        evict_to_fit();
+    }
+
+    // evicts down to the new budget under the lock; callers shrinking a
+    // large cache lower it in steps (see ShardedCache::set_capacity)
+    void set_capacity(size_t cap_bytes) {
+        lock_guard<mutex> lock(mtx);
+        capacity = cap_bytes;
+        policy.set_capacity(cap_bytes);
+        evict_to_fit();
+    }
+
+    bool get(const string& key, string& value) {
+        lock_guard<mutex> lock(mtx);
+        CacheNode** found = index.find(key);
+        if (!found) {
+            misses++;
+            policy.on_miss(key);
+            return false;
+        }
+        hits++;
+        value = (*found)->value;
+        policy.on_hit(*found);
+        return true;
+    }
+
+    void remove(const string& key) {
+        lock_guard<mutex> lock(mtx);
+        remove_locked(key);
+    }
+
+    void remove_batch(const vector<string>& keys) {
+        lock_guard<mutex> lock(mtx);
+        for (auto& key : keys) remove_locked(key);
+    }
+
+    void hot_keys(vector<string>& out, size_t limit) const {
+        lock_guard<mutex> lock(mtx);
+        policy.hottest(out, out.size() + limit);
+    }
+
+    CacheStats stats() const {
+        lock_guard<mutex> lock(mtx);
+        CacheStats s;
+        s.hits = hits;
+        s.misses = misses;
+        s.evictions = evictions;
+        s.entries = index.size();
+        s.bytes = bytes;
+        s.capacity_bytes = capacity;
+        return s;
+    }
+};
+
+typedef PolicyCache<LRUPolicy> LRUCache;
+typedef PolicyCache<SLRUPolicy> SLRUCache;
+typedef PolicyCache<ARCPolicy> ARCCache;
+typedef PolicyCache<TinyLFUPolicy> TinyLFUCache;
+
+// Event counter for paths that run without an exclusive lock: increments
+// go to one of several cache-line-sized stripes, picked per thread, so
+// concurrent readers don't all write the same line. load() sums them.
+class StripedCounter {
+    static const size_t STRIPES = 32;
+    struct alignas(64) Stripe { atomic<uint64_t> n{0}; };
+    Stripe stripes[STRIPES];
+
+    static size_t stripe() {
+        static atomic<size_t> next{0};
+        thread_local size_t mine = next.fetch_add(1, memory_order_relaxed) % STRIPES;
+        return mine;
+    }
+
+public:
+    void add() { stripes[stripe()].n.fetch_add(1, memory_order_relaxed); }
+    uint64_t load() const {
+        uint64_t sum = 0;
+        for (auto& st : stripes) sum += st.n.load(memory_order_relaxed);
+        return sum;
+    }
+};
+
+// CLOCK Cache Implementation: approximate LRU where a hit only sets the
+// slot's reference bit, so lookups run under a shared lock and never
+// reorder or allocate. The hand clears bits and evicts the first slot
+// that hasn't been referenced since its last pass. Slots are added while
+// the byte budget allows and reused after eviction.
+class ClockCache {
+    struct Slot {
+        string key;
+        string value;
+        atomic<bool> ref{false};
+        bool used = false;
+    };
+    static const size_t SLOT_OVERHEAD = sizeof(Slot) + index_node_bytes<string, size_t>();
+
+    size_t capacity;
+    size_t bytes = 0;
+    deque<Slot> slots;          // deque: growing never moves existing slots
+    vector<size_t> free_slots;
+    unordered_map<string, size_t> index;
+    size_t hand = 0;
+    StripedCounter hits, misses;
+    uint64_t evictions = 0;
+    EvictionSink on_evict;
+    mutable shared_mutex mtx;
+
+    static size_t charge(const Slot& s) {
+        return SLOT_OVERHEAD + 2 * string_heap_bytes(s.key) + string_heap_bytes(s.value);
+    }
+
+    void release(size_t pos) {
+        Slot& s = slots[pos];
+        bytes -= charge(s);
+        s.used = false;
+        string().swap(s.key);
+        string().swap(s.value);
+        bytes += SLOT_OVERHEAD;     // an empty slot still costs its struct
+        free_slots.push_back(pos);
+    }
+
+    void remove_locked(const string& key) {
+        auto it = index.find(key);
+        if (it == index.end()) return;
+        size_t pos = it->second;
+        index.erase(it);
+        release(pos);
+    }
+
+    // keep: slot that was just filled and must not be the victim unless alone
+    void evict_one(size_t keep) {
+        while (true) {
+            size_t cur = hand;
+            Slot& s = slots[cur];
+            hand = (hand + 1) % slots.size();
+            if (!s.used || (cur == keep && index.size() > 1)) continue;
+            if (s.ref.load(memory_order_relaxed)) {
+                s.ref.store(false, memory_order_relaxed);
+                continue;
+            }
+            if (on_evict) on_evict(s.key, s.value);
+            index.erase(s.key);
+            release(cur);
+            evictions++;
+            return;
+        }
+    }
+
+    // free slots are charged as bare structs; return their memory to the budget
+    void shrink_free_tail() {
+        while (!slots.empty() && !slots.back().used) {
+            size_t last = slots.size() - 1;
+            auto it = find(free_slots.begin(), free_slots.end(), last);
+            if (it == free_slots.end()) break;
+            free_slots.erase(it);
+            slots.pop_back();
+            bytes -= SLOT_OVERHEAD;
+        }
+        if (hand >= slots.size()) hand = 0;
+    }
+
+    // moves entries from the end of the deque into free slots, so the tail
+    // can be popped and every free slot's struct leaves the budget
+    void fill_holes() {
+        sort(free_slots.begin(), free_slots.end());
+        size_t lo = 0;
+        while (lo < free_slots.size()) {
+            size_t last = slots.size() - 1;
+            if (free_slots.back() != last) {
+                size_t pos = free_slots[lo++];
+                Slot& hole = slots[pos];
+                Slot& src = slots[last];
+                hole.key.swap(src.key);
+                hole.value.swap(src.value);
+                hole.used = true;
+                hole.ref.store(src.ref.load(memory_order_relaxed), memory_order_relaxed);
+                index[hole.key] = pos;
+            } else {
+                free_slots.pop_back();
+            }
+            slots.pop_back();
+            bytes -= SLOT_OVERHEAD;
+        }
+        free_slots.clear();
+        if (hand >= slots.size()) hand = 0;
+    }
+
+public:
+    ClockCache(size_t cap_bytes) : capacity(cap_bytes) {}
+
+    void set_eviction_sink(EvictionSink sink) { on_evict = sink; }
+
+    void put(const string& key, const string& value) {
+        unique_lock<shared_mutex> lock(mtx);
+        auto it = index.find(key);
+        size_t pos;
+        if (it != index.end()) {
+            pos = it->second;
+            Slot& s = slots[pos];
+            bytes -= charge(s);
+            s.value = value;
+            bytes += charge(s);
+            s.ref.store(true, memory_order_relaxed);
+        } else {
+            if (!free_slots.empty()) {
+                pos = free_slots.back();
+                free_slots.pop_back();
+                bytes -= SLOT_OVERHEAD;
+            } else {
+                pos = slots.size();
+                slots.emplace_back();
+            }
+            Slot& s = slots[pos];
+            s.key = key;
+            s.value = value;
+            s.used = true;
+            s.ref.store(false, memory_order_relaxed);
+            index.emplace(key, pos);
+            bytes += charge(s);
+        }
+
+        // an entry larger than the whole budget ends up evicting itself
+        while (bytes > capacity && !index.empty()) evict_one(pos);
+        if (bytes > capacity) shrink_free_tail();
+    }
+
+    bool get(const string& key, string& value) {
+        shared_lock<shared_mutex> lock(mtx);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            misses.add();
+            return false;
+        }
+        Slot& s = slots[it->second];
+        // only write the bit when it changes to keep hot slots' lines shared
+        if (!s.ref.load(memory_order_relaxed)) s.ref.store(true, memory_order_relaxed);
+        value = s.value;
+        hits.add();
+        return true;
+    }
+
+    void remove(const string& key) {
+        unique_lock<shared_mutex> lock(mtx);
+        remove_locked(key);
+    }
+
+    void remove_batch(const vector<string>& keys) {
+        unique_lock<shared_mutex> lock(mtx);
+        for (auto& key : keys) remove_locked(key);
+    }
+
+    // free slots come back to the budget once fill_holes() drops them
+    void set_capacity(size_t cap_bytes) {
+        unique_lock<shared_mutex> lock(mtx);
+        capacity = cap_bytes;
+        while (bytes - free_slots.size() * SLOT_OVERHEAD > capacity && !index.empty())
+            evict_one(SIZE_MAX);
+        fill_holes();
+    }
+
+    // referenced entries first, then the rest
+    void hot_keys(vector<string>& out, size_t limit) const {
+        shared_lock<shared_mutex> lock(mtx);
+        size_t end = out.size() + limit;
+        for (int pass = 0; pass < 2; pass++) {
+            for (auto& s : slots) {
+                if (out.size() >= end) return;
+                if (s.used && s.ref.load(memory_order_relaxed) == (pass == 0)) out.push_back(s.key);
+            }
+        }
+    }
+
+    CacheStats stats() const {
+        shared_lock<shared_mutex> lock(mtx);
+        CacheStats st;
+        st.hits = hits.load();
+        st.misses = misses.load();
+        st.evictions = evictions;
+        st.entries = index.size();
+        st.bytes = bytes;
+        st.capacity_bytes = capacity;
+        return st;
+    }
+};
+
+// Epoch-based reclamation for structures that are read without a lock. A
+// reader announces the global epoch in its own slot for the lifetime of a
+// Guard. A writer that unlinks an object stamps it with the epoch at unlink
+// time and frees it only once every active reader announces a later epoch,
+// i.e. entered after the unlink and so cannot still be holding it. Threads
+// beyond MAX_THREADS get an inactive guard and must take the locked path.
+class EpochReclaimer {
+    static const size_t MAX_THREADS = 1024;
+    static const uint64_t IDLE = UINT64_MAX;
+
+    struct alignas(64) ThreadSlot {
+        atomic<uint64_t> epoch{IDLE};
+        atomic<bool> claimed{false};
+    };
+
+    atomic<uint64_t> global{1};
+    atomic<size_t> high_water{0};
+    ThreadSlot threads[MAX_THREADS];
+
+    // a thread's slot is claimed on its first guard and freed when it exits
+    struct Registration {
+        ThreadSlot* slot = nullptr;
+        bool tried = false;
+        ~Registration() {
+            if (slot) slot->claimed.store(false, memory_order_release);
+        }
+    };
+
+    ThreadSlot* my_slot() {
+        thread_local Registration reg;
+        if (reg.tried) return reg.slot;
+        reg.tried = true;
+        for (size_t i = 0; i < MAX_THREADS; i++) {
+            bool expected = false;
+            if (threads[i].claimed.compare_exchange_strong(expected, true)) {
+                size_t hw = high_water.load();
+                while (hw < i + 1 && !high_water.compare_exchange_weak(hw, i + 1)) {}
+                reg.slot = &threads[i];
+                break;
+            }
+        }
+        return reg.slot;
+    }
+
+    ThreadSlot* enter() {
+        ThreadSlot* s = my_slot();
+        if (!s) return nullptr;
+        // re-check after publishing, so a writer scanning concurrently either
+        // sees this epoch or has already advanced past it
+        uint64_t e = global.load();
+        while (true) {
+            s->epoch.store(e);
+            uint64_t now = global.load();
+            if (now == e) return s;
+            e = now;
+        }
+    }
+
+public:
+    static EpochReclaimer& instance() {
+        static EpochReclaimer r;
+        return r;
+    }
+
+    class Guard {
+        ThreadSlot* slot;
+    public:
+        Guard() : slot(instance().enter()) {}
+        ~Guard() {
+            if (slot) slot->epoch.store(IDLE, memory_order_release);
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        bool active() const { return slot != nullptr; }
+    };
+
+    // stamp for an object that was just unlinked
+    uint64_t retire_epoch() { return global.fetch_add(1); }
+
+    // objects stamped with an epoch below this are unreachable by readers
+    uint64_t safe_epoch() const {
+        uint64_t m = global.load();
+        size_t n = high_water.load();
+        for (size_t i = 0; i < n; i++) m = min<uint64_t>(m, threads[i].epoch.load());
+        return m;
+    }
+};
+
+// LRU cache whose hits take no lock. Entries are immutable once published:
+// readers find them through atomic bucket chains under an epoch guard and
+// copy the value out, while writers, serialized by the shard mutex, link
+// new entries in, replace an updated entry with a fresh one and hand
+// unlinked entries to the EpochReclaimer. Recency is updated lazily: a hit
+// only sets the entry's reference bit, and eviction moves a referenced tail
+// entry back to the front instead of evicting it, so the list order
+// approximates LRU without readers ever touching it. Growing the bucket
+// array relinks chains in place; readers notice through a sequence counter
+// and repeat a miss under the lock.
+class EpochLRUCache {
+    struct Entry {
+        string key;
+        string value;
+        size_t hash;
+        atomic<Entry*> chain{nullptr};
+        atomic<bool> ref{false};
+        Entry* prev = nullptr;      // LRU list, writer side only
+        Entry* next = nullptr;
+    };
+
+    struct Table {
+        size_t mask;
+        unique_ptr<atomic<Entry*>[]> heads;
+
+        explicit Table(size_t n) : mask(n - 1), heads(new atomic<Entry*>[n]) {
+            for (size_t i = 0; i < n; i++) heads[i].store(nullptr, memory_order_relaxed);
+        }
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        Entry* entry;
+        Table* table;
+    };
+
+    // the bucket array holds at most two heads per entry
+    static const size_t ENTRY_OVERHEAD = sizeof(Entry) + 2 * sizeof(atomic<Entry*>);
+    static const size_t RECLAIM_BATCH = 64;
+
+    size_t capacity;
+    size_t bytes = 0;
+    size_t count = 0;
+    atomic<Table*> table;
+    atomic<uint64_t> resize_seq{0};     // odd while chains are being relinked
+    Entry* head = nullptr;              // most recently used
+    Entry* tail = nullptr;
+    vector<Retired> retired;
+    StripedCounter hits, misses;
+    uint64_t evictions = 0;
+    EvictionSink on_evict;
+    mutable mutex mtx;
+
+    static size_t charge(const Entry* e) {
+        return ENTRY_OVERHEAD + string_heap_bytes(e->key) + string_heap_bytes(e->value);
+    }
+
+    static Entry* lookup(const Table* t, const string& key, size_t h) {
+        for (Entry* e = t->heads[h & t->mask].load(memory_order_acquire); e;
+             e = e->chain.load(memory_order_acquire))
+            if (e->hash == h && e->key == key) return e;
+        return nullptr;
+    }
+
+    // link pointing at e in its bucket chain (writer side)
+    atomic<Entry*>* link_to(Entry* e) {
+        Table* t = table.load(memory_order_relaxed);
+        atomic<Entry*>* link = &t->heads[e->hash & t->mask];
+        while (link->load(memory_order_relaxed) != e) link = &link->load(memory_order_relaxed)->chain;
+        return link;
+    }
+
+    void list_unlink(Entry* e) {
+        (e->prev ? e->prev->next : head) = e->next;
+        (e->next ? e->next->prev : tail) = e->prev;
+        e->prev = e->next = nullptr;
+    }
+
+    void list_push_front(Entry* e) {
+        e->prev = nullptr;
+        e->next = head;
+        (head ? head->prev : tail) = e;
+        head = e;
+    }
+
+    void retire(Entry* e, Table* t) {
+        retired.push_back({EpochReclaimer::instance().retire_epoch(), e, t});
+    }
+
+    void reclaim() {
+        if (retired.size() < RECLAIM_BATCH) return;
+        uint64_t safe = EpochReclaimer::instance().safe_epoch();
+        size_t kept = 0;
+        for (auto& r : retired) {
+            if (r.epoch < safe) {
+                delete r.entry;
+                delete r.table;
+            } else {
+                retired[kept++] = r;
+            }
+        }
+        retired.resize(kept);
+    }
+
+    // unlink from the chain (readers already on e still follow e->chain)
+    void erase(Entry* e) {
+        link_to(e)->store(e->chain.load(memory_order_relaxed), memory_order_release);
+        list_unlink(e);
+        bytes -= charge(e);
+        count--;
+        retire(e, nullptr);
+    }
+
+    // keep: entry that was just written and must not be the victim unless alone
+    void evict_one(Entry* keep) {
+        while (true) {
+            Entry* e = tail;
+            if ((e == keep && count > 1) || e->ref.load(memory_order_relaxed)) {
+                e->ref.store(false, memory_order_relaxed);
+                list_unlink(e);
+                list_push_front(e);
+                continue;
+            }
+            if (on_evict) on_evict(e->key, e->value);
+            erase(e);
+            evictions++;
+            return;
+        }
+    }
+
+    void grow() {
+        Table* old_t = table.load(memory_order_relaxed);
+        Table* new_t = new Table((old_t->mask + 1) * 2);
+        uint64_t seq = resize_seq.load(memory_order_relaxed);
+        resize_seq.store(seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        for (size_t b = 0; b <= old_t->mask; b++) {
+            Entry* e = old_t->heads[b].load(memory_order_relaxed);
+            while (e) {
+                Entry* next = e->chain.load(memory_order_relaxed);
+                atomic<Entry*>& dst = new_t->heads[e->hash & new_t->mask];
+                e->chain.store(dst.load(memory_order_relaxed), memory_order_release);
+                dst.store(e, memory_order_relaxed);
+                e = next;
+            }
+        }
+        table.store(new_t, memory_order_release);
+        resize_seq.store(seq + 2, memory_order_release);
+        retire(nullptr, old_t);
+    }
+
+public:
+    EpochLRUCache(size_t cap_bytes) : capacity(cap_bytes), table(new Table(64)) {}
+
+    void set_eviction_sink(EvictionSink sink) { on_evict = sink; }
+
+    // no reader can be inside a shard that is being destroyed
+    ~EpochLRUCache() {
+        for (Entry* e = head; e;) {
+            Entry* next = e->next;
+            delete e;
+            e = next;
+        }
+        for (auto& r : retired) {
+            delete r.entry;
+            delete r.table;
+        }
+        delete table.load();
+    }
+
+    void put(const string& key, const string& value) {
+        lock_guard<mutex> lock(mtx);
+        size_t h = index_hash(key);
+        Entry* n = new Entry;
+        n->key = key;
+        n->value = value;
+        n->hash = h;
+
+        Entry* old = lookup(table.load(memory_order_relaxed), key, h);
+        if (old) {
+            // readers see either the old entry or the new one, never a mix
+            n->chain.store(old->chain.load(memory_order_relaxed), memory_order_relaxed);
+            n->ref.store(true, memory_order_relaxed);
+            link_to(old)->store(n, memory_order_release);
+            n->prev = old->prev;
+            n->next = old->next;
+            (n->prev ? n->prev->next : head) = n;
+            (n->next ? n->next->prev : tail) = n;
+            bytes -= charge(old);
+            retire(old, nullptr);
+        } else {
+            Table* t = table.load(memory_order_relaxed);
+            atomic<Entry*>& bucket = t->heads[h & t->mask];
+            n->chain.store(bucket.load(memory_order_relaxed), memory_order_relaxed);
+            bucket.store(n, memory_order_release);
+            list_push_front(n);
+            count++;
+            if (count > t->mask + 1) grow();
+        }
+        bytes += charge(n);
+
+        // an entry larger than the whole budget ends up evicting itself
+        while (bytes > capacity && count > 0) evict_one(n);
+        reclaim();
+    }
+
+    bool get(const string& key, string& value) {
+        size_t h = index_hash(key);
+        {
+            EpochReclaimer::Guard guard;
+            uint64_t seq = resize_seq.load(memory_order_acquire);
+            if (guard.active() && !(seq & 1)) {
+                Entry* e = lookup(table.load(memory_order_acquire), key, h);
+                if (e) {
+                    // only write the bit when it changes to keep hot lines shared
+                    if (!e->ref.load(memory_order_relaxed)) e->ref.store(true, memory_order_relaxed);
+                    value = e->value;
+                    hits.add();
+                    return true;
+                }
+                atomic_thread_fence(memory_order_acquire);
+                if (resize_seq.load(memory_order_relaxed) == seq) {
+                    misses.add();
+                    return false;
+                }
+            }
+        }
+
+        // raced with a resize (or no reader slot): settle it under the lock
+        lock_guard<mutex> lock(mtx);
+        Entry* e = lookup(table.load(memory_order_relaxed), key, h);
+        if (!e) {
+            misses.add();
+            return false;
+        }
+        e->ref.store(true, memory_order_relaxed);
+        value = e->value;
+        hits.add();
+        return true;
+    }
+
+    void remove(const string& key) {
+        lock_guard<mutex> lock(mtx);
+        Entry* e = lookup(table.load(memory_order_relaxed), key, index_hash(key));
+        if (!e) return;
+        erase(e);
+        reclaim();
+    }
+
+    void remove_batch(const vector<string>& keys) {
+        lock_guard<mutex> lock(mtx);
+        for (auto& key : keys) {
+            Entry* e = lookup(table.load(memory_order_relaxed), key, index_hash(key));
+            if (e) erase(e);
+        }
+        reclaim();
+    }
+
+    void set_capacity(size_t cap_bytes) {
+        lock_guard<mutex> lock(mtx);
+        capacity = cap_bytes;
+        while (bytes > capacity && count > 0) evict_one(nullptr);
+        reclaim();
+    }
+
+    // referenced entries first, then the rest, each in list order
+    void hot_keys(vector<string>& out, size_t limit) const {
+        lock_guard<mutex> lock(mtx);
+        size_t end = out.size() + limit;
+        for (int pass = 0; pass < 2; pass++) {
+            for (Entry* e = head; e && out.size() < end; e = e->next)
+                if (e->ref.load(memory_order_relaxed) == (pass == 0)) out.push_back(e->key);
+        }
+    }
+
+    CacheStats stats() const {
+        lock_guard<mutex> lock(mtx);
+        CacheStats st;
+        st.hits = hits.load();
+        st.misses = misses.load();
+        st.evictions = evictions;
+        st.entries = count;
+        st.bytes = bytes;
+        st.capacity_bytes = capacity;
+        return st;
+    }
+};
+
+// Slab LRU Cache Implementation: all entries live in one preallocated slab
+// of fixed-size slots (optionally backed by huge pages), linked into the LRU
+// list by intrusive prev/next indices and indexed by an open-addressing
+// table of slot numbers. The key is stored once, inside its slot, so
+// steady-state get/put never touch the heap. Entries whose key + value
+// don't fit in a slot are not cached. The byte budget fixes the slot count
+// up front, since every entry costs exactly one slot plus its index share;
+// resizing can only lower or restore the number of slots in use.
+class SlabLRUCache {
+    static const uint32_t NIL = UINT32_MAX;
+
+    struct SlotHeader {
+        uint32_t prev;
+        uint32_t next;
+        uint64_t hash;
+        uint32_t klen;
+        uint32_t vlen;
+    };
+
+    size_t capacity;         // slots in the slab
+    size_t limit;            // slots that may be in use, <= capacity
+    size_t payload;          // bytes available for key + value
+    size_t stride;           // bytes per slot, header included
+    char* slab = nullptr;
+    size_t slab_bytes = 0;
+    bool huge = false;
+
+    vector<uint32_t> table;  // slot index + 1, 0 = empty
+    size_t mask;
+    uint32_t head = NIL, tail = NIL, free_head = NIL;
+    size_t used = 0;
+    uint64_t hits = 0, misses = 0, evictions = 0;
+    EvictionSink on_evict;
+    mutable mutex mtx;
+
+    SlotHeader* slot(uint32_t i) const { return (SlotHeader*)(slab + (size_t)i * stride); }
+    char* key_of(SlotHeader* h) const { return (char*)(h + 1); }
+
+    void unlink(uint32_t i) {
+        SlotHeader* h = slot(i);
+        if (h->prev != NIL) slot(h->prev)->next = h->next; else head = h->next;
+        if (h->next != NIL) slot(h->next)->prev = h->prev; else tail = h->prev;
+    }
+
+    void link_front(uint32_t i) {
+        SlotHeader* h = slot(i);
+        h->prev = NIL;
+        h->next = head;
+        if (head != NIL) slot(head)->prev = i;
+        head = i;
+        if (tail == NIL) tail = i;
+    }
+
+    // position in table holding key, or of the empty bucket ending its probe
+    size_t find_pos(const string& key, uint64_t hv) const {
+        size_t pos = hv & mask;
+        while (table[pos]) {
+            SlotHeader* h = slot(table[pos] - 1);
+            if (h->hash == hv && h->klen == key.size() &&
+                memcmp(key_of(h), key.data(), key.size()) == 0)
+                return pos;
+            pos = (pos + 1) & mask;
+        }
+        return pos;
+    }
+
+    // backward-shift deletion keeps probe chains intact without tombstones
+    void erase_pos(size_t pos) {
+        size_t hole = pos;
+        size_t cur = (pos + 1) & mask;
+        while (table[cur]) {
+            size_t home = slot(table[cur] - 1)->hash & mask;
+            if (((cur - home) & mask) >= ((cur - hole) & mask)) {
+                table[hole] = table[cur];
+                hole = cur;
+            }
+            cur = (cur + 1) & mask;
+        }
+        table[hole] = 0;
+    }
+
+    void release(uint32_t i) {
+        unlink(i);
+        slot(i)->next = free_head;
+        free_head = i;
+        used--;
+    }
+
+    void erase_slot(uint32_t i) {
+        size_t pos = slot(i)->hash & mask;
+        while (table[pos] != i + 1) pos = (pos + 1) & mask;
+        erase_pos(pos);
+        release(i);
+    }
+
+    void evict_tail() {
+        SlotHeader* h = slot(tail);
+        if (on_evict)
+            on_evict(string(key_of(h), h->klen), string(key_of(h) + h->klen, h->vlen));
+        erase_slot(tail);
+        evictions++;
+    }
+
+    void remove_locked(const string& key, uint64_t hv) {
+        size_t pos = find_pos(key, hv);
+        if (!table[pos]) return;
+        uint32_t i = table[pos] - 1;
+        erase_pos(pos);
+        release(i);
+    }
+
+public:
+    SlabLRUCache(size_t cap_bytes, size_t slot_payload, bool huge_pages)
+        : payload(slot_payload) {
+        stride = (sizeof(SlotHeader) + payload + 63) & ~(size_t)63;
+        capacity = max<size_t>(cap_bytes / entry_bytes(), 1);
+        limit = capacity;
+        slab_bytes = capacity * stride;
+        if (huge_pages) {
+            size_t hp = 2 << 20;
+            size_t len = (slab_bytes + hp - 1) & ~(hp - 1);
+            void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) { slab = (char*)p; slab_bytes = len; huge = true; }
+        }
+        if (!slab) {
+            void* p = mmap(nullptr, slab_bytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) throw bad_alloc();
+            slab = (char*)p;
+            if (huge_pages) madvise(slab, slab_bytes, MADV_HUGEPAGE);
+        }
+
+        size_t buckets = 16;
+        while (buckets < capacity * 2) buckets <<= 1;
+        table.assign(buckets, 0);
+        mask = buckets - 1;
+        for (size_t i = capacity; i > 0; i--) {
+            slot(i - 1)->next = free_head;
+            free_head = i - 1;
+        }
+    }
+
+    ~SlabLRUCache() { if (slab) munmap(slab, slab_bytes); }
+
+    // slot plus up to four index buckets (the table has 2-4x as many
+    // buckets as slots, so load stays at or under 50%)
+    size_t entry_bytes() const { return stride + 4 * sizeof(uint32_t); }
+
+    SlabLRUCache(const SlabLRUCache&) = delete;
+    SlabLRUCache& operator=(const SlabLRUCache&) = delete;
+
+    void set_eviction_sink(EvictionSink sink) { on_evict = sink; }
+
+    void put(const string& key, const string& value) {
+        uint64_t hv = index_hash(key);
+        lock_guard<mutex> lock(mtx);
+        if (key.size() + value.size() > payload) {
+            // can't hold the new value; drop any stale copy instead
+            remove_locked(key, hv);
+            return;
+        }
+
+        size_t pos = find_pos(key, hv);
+        uint32_t i;
+        if (table[pos]) {
+            i = table[pos] - 1;
+            unlink(i);
+        } else {
+            if (used >= limit) {
+                evict_tail();
+                pos = find_pos(key, hv);
+            }
+            i = free_head;
+            free_head = slot(i)->next;
+            used++;
+            SlotHeader* h = slot(i);
+            h->hash = hv;
+            h->klen = key.size();
+            memcpy(key_of(h), key.data(), key.size());
+            table[pos] = i + 1;
+        }
+        SlotHeader* h = slot(i);
+        h->vlen = value.size();
+        memcpy(key_of(h) + h->klen, value.data(), value.size());
+        link_front(i);
+    }
+
+    bool get(const string& key, string& value) {
+        uint64_t hv = index_hash(key);
+        lock_guard<mutex> lock(mtx);
+        size_t pos = find_pos(key, hv);
+        if (!table[pos]) { misses++; return false; }
+
+        hits++;
+        uint32_t i = table[pos] - 1;
+        SlotHeader* h = slot(i);
+        value.assign(key_of(h) + h->klen, h->vlen);
+        if (head != i) {
+            unlink(i);
+            link_front(i);
+        }
+        return true;
+    }
+
+    void remove(const string& key) {
+        uint64_t hv = index_hash(key);
+        lock_guard<mutex> lock(mtx);
+        remove_locked(key, hv);
+    }
+
+    void remove_batch(const vector<string>& keys) {
+        lock_guard<mutex> lock(mtx);
+        for (auto& key : keys) remove_locked(key, index_hash(key));
+    }
+
+    // the slab is sized at startup, so growth stops at its slot count
+    void set_capacity(size_t cap_bytes) {
+        lock_guard<mutex> lock(mtx);
+        limit = min(capacity, max<size_t>(cap_bytes / entry_bytes(), 1));
+        while (used > limit) evict_tail();
+    }
+
+    void hot_keys(vector<string>& out, size_t limit) const {
+        lock_guard<mutex> lock(mtx);
+        size_t end = out.size() + limit;
+        for (uint32_t i = head; i != NIL && out.size() < end; i = slot(i)->next)
+            out.emplace_back(key_of(slot(i)), slot(i)->klen);
+    }
+
+    CacheStats stats() const {
+        lock_guard<mutex> lock(mtx);
+        CacheStats s;
+        s.hits = hits;
+        s.misses = misses;
+        s.evictions = evictions;
+        s.entries = used;
+        s.bytes = used * entry_bytes();
+        s.capacity_bytes = limit * entry_bytes();
+        return s;
+    }
+};
+
+// Common interface of the cache engines selectable at startup
+class KVCache {
+public:
+    virtual ~KVCache() {}
+    virtual void put(const string& key, const string& value) = 0;
+    virtual bool get(const string& key, string& value) = 0;
+    virtual void remove(const string& key) = 0;
+    // removes many keys, taking each shard's lock once
+    virtual void remove_batch(const vector<string>& keys) = 0;
+    // set before serving traffic; evicted entries are passed to it
+    virtual void set_eviction_sink(EvictionSink sink) = 0;
+    virtual size_t shard_count() const = 0;
+    virtual vector<CacheStats> shard_stats() const = 0;
+    // up to limit resident keys, roughly hottest first
+    virtual vector<string> hot_keys(size_t limit) const = 0;
+    // changes the total budget; shrinking evicts in steps of about
+    // step_bytes per shard, releasing the shard lock in between. Returns
+    // false if stop() turned true before the new budget was reached.
+    virtual bool set_capacity(size_t capacity_bytes, size_t step_bytes,
+                              const function<bool()>& stop) = 0;
+};
+
+// Sharded cache: keys are spread over independent shards by hash, each with
+// its own lock, so requests for different keys don't serialize on one mutex
+template <class Shard>
+class ShardedCache : public KVCache {
+    vector<unique_ptr<Shard>> shards;
+
+    Shard& shard_for(const string& key) const {
+        return *shards[hash<string>{}(key) % shards.size()];
+    }
+
+public:
+    template <class... Args>
+    ShardedCache(size_t nshards, size_t capacity_bytes, const Args&... args) {
+        if (nshards == 0) nshards = 1;
+        size_t per_shard = max<size_t>(1, capacity_bytes / nshards);
+        for (size_t i = 0; i < nshards; i++)
+            shards.emplace_back(new Shard(per_shard, args...));
+    }
+
+    void put(const string& key, const string& value) override { shard_for(key).put(key, value); }
+    bool get(const string& key, string& value) override { return shard_for(key).get(key, value); }
+    void remove(const string& key) override { shard_for(key).remove(key); }
+
+    void set_eviction_sink(EvictionSink sink) override {
+        for (auto& s : shards) s->set_eviction_sink(sink);
+    }
+
+    void remove_batch(const vector<string>& keys) override {
+        vector<vector<string>> per_shard(shards.size());
+        for (auto& key : keys) per_shard[hash<string>{}(key) % shards.size()].push_back(key);
+        for (size_t i = 0; i < shards.size(); i++)
+            if (!per_shard[i].empty()) shards[i]->remove_batch(per_shard[i]);
+    }
+
+    size_t shard_count() const override { return shards.size(); }
+
+    vector<CacheStats> shard_stats() const override {
+        vector<CacheStats> out;
+        for (auto& s : shards) out.push_back(s->stats());
+        return out;
+    }
+
+    vector<string> hot_keys(size_t limit) const override {
+        vector<string> out;
+        size_t per_shard = (limit + shards.size() - 1) / shards.size();
+        for (auto& s : shards) s->hot_keys(out, per_shard);
+        if (out.size() > limit) out.resize(limit);
+        return out;
+    }
+
+    // shards shrink round-robin, one step each per round, so they lose
+    // entries evenly and no shard lock is held for more than one step
+    bool set_capacity(size_t capacity_bytes, size_t step_bytes,
+                      const function<bool()>& stop) override {
+        size_t target = max<size_t>(1, capacity_bytes / shards.size());
+        step_bytes = max<size_t>(1, step_bytes);
+        vector<size_t> current;
+        for (auto& s : shards) current.push_back(s->stats().capacity_bytes);
+
+        bool shrinking = true;
+        while (shrinking) {
+            shrinking = false;
+            for (size_t i = 0; i < shards.size(); i++) {
+                if (current[i] == target) continue;
+                if (stop()) return false;
+                if (current[i] < target) current[i] = target;
+                else current[i] = max(target, current[i] > step_bytes ? current[i] - step_bytes : 0);
+                shards[i]->set_capacity(current[i]);
+                shrinking = shrinking || current[i] != target;
+            }
+            this_thread::yield();
+        }
+        return true;
+    }
+};
+
+// Compression of large values: a KVCache decorator that deflates (zlib,
+// fastest level) values of at least min_bytes before handing them to the
+// engine, so the engine charges the compressed size against its budget,
+// and inflates them on a hit, outside the shard lock. Values below the
+// threshold, or that don't shrink, are stored as they are. Stored values
+// are tagged by their first byte: COMPRESSED is followed by the original
+// length (u32) and the deflate stream; a raw value starting with either
+// tag byte gets an ESCAPED byte in front, and any other value is stored
+// unchanged, so small values cost nothing extra.
+class CompressedCache : public KVCache {
+    static const char ESCAPED = '\x00';
+    static const char COMPRESSED = '\x01';
+
+    unique_ptr<KVCache> inner;
+    size_t min_bytes;
+
+    atomic<uint64_t> compressed{0}, skipped{0}, bytes_in{0}, bytes_out{0};
+    atomic<uint64_t> inflated{0}, corrupt{0};
+
+    // per-thread codec state, reset between values instead of reallocated
+    static z_stream& deflater() {
+        thread_local struct Deflater {
+            z_stream zs{};
+            Deflater() { deflateInit(&zs, Z_BEST_SPEED); }
+            ~Deflater() { deflateEnd(&zs); }
+        } d;
+        return d.zs;
+    }
+    static z_stream& inflater() {
+        thread_local struct Inflater {
+            z_stream zs{};
+            Inflater() { inflateInit(&zs); }
+            ~Inflater() { inflateEnd(&zs); }
+        } i;
+        return i.zs;
+    }
+
+    string encode(const string& value) {
+        if (value.size() >= min_bytes && value.size() <= UINT32_MAX) {
+            z_stream& zs = deflater();
+            deflateReset(&zs);
+            size_t header = 1 + sizeof(uint32_t);
+            string out(header + deflateBound(&zs, value.size()), '\0');
+            zs.next_in = (Bytef*)value.data();
+            zs.avail_in = value.size();
+            zs.next_out = (Bytef*)&out[header];
+            zs.avail_out = out.size() - header;
+            if (deflate(&zs, Z_FINISH) == Z_STREAM_END && header + zs.total_out < value.size()) {
+                out.resize(header + zs.total_out);
+                out[0] = COMPRESSED;
+                uint32_t len = value.size();
+                memcpy(&out[1], &len, sizeof(len));
+                compressed.fetch_add(1, memory_order_relaxed);
+                bytes_in.fetch_add(value.size(), memory_order_relaxed);
+                bytes_out.fetch_add(out.size(), memory_order_relaxed);
+                return out;
+            }
+            skipped.fetch_add(1, memory_order_relaxed);
+        }
+        return ESCAPED + value;
+    }
+
+    // false if a compressed value fails to inflate
+    bool decode(const string& stored, string& value) {
+        if (stored.empty() || (stored[0] != ESCAPED && stored[0] != COMPRESSED)) {
+            value = stored;
+            return true;
+        }
+        if (stored[0] == ESCAPED) {
+            value.assign(stored, 1, string::npos);
+            return true;
+        }
+        uint32_t len;
+        if (stored.size() < 1 + sizeof(len)) return false;
+        memcpy(&len, &stored[1], sizeof(len));
+        z_stream& zs = inflater();
+        inflateReset(&zs);
+        value.resize(len);
+        zs.next_in = (Bytef*)&stored[1 + sizeof(len)];
+        zs.avail_in = stored.size() - 1 - sizeof(len);
+        zs.next_out = (Bytef*)&value[0];
+        zs.avail_out = len;
+        if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out != len) return false;
+        inflated.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    bool needs_encoding(const string& value) const {
+        return value.size() >= min_bytes ||
+               (!value.empty() && (value[0] == ESCAPED || value[0] == COMPRESSED));
+    }
+
+public:
+    CompressedCache(unique_ptr<KVCache> inner, size_t min_bytes)
+        : inner(move(inner)), min_bytes(max<size_t>(1, min_bytes)) {}
+
+    void put(const string& key, const string& value) override {
+        if (needs_encoding(value)) inner->put(key, encode(value));
+        else inner->put(key, value);
+    }
+
+    bool get(const string& key, string& value) override {
+        string stored;
+        if (!inner->get(key, stored)) return false;
+        if (decode(stored, value)) return true;
+        corrupt.fetch_add(1, memory_order_relaxed);
+        inner->remove(key);
+        return false;
+    }
+
+    void remove(const string& key) override { inner->remove(key); }
+    void remove_batch(const vector<string>& keys) override { inner->remove_batch(keys); }
+
+    // the sink sees original values
+    void set_eviction_sink(EvictionSink sink) override {
+        if (!sink) {
+            inner->set_eviction_sink(nullptr);
+            return;
+        }
+        inner->set_eviction_sink([this, sink](const string& key, const string& stored) {
+            string value;
+            if (decode(stored, value)) sink(key, value);
+        });
+    }
+
+    size_t shard_count() const override { return inner->shard_count(); }
+    vector<CacheStats> shard_stats() const override { return inner->shard_stats(); }
+    vector<string> hot_keys(size_t limit) const override { return inner->hot_keys(limit); }
+    bool set_capacity(size_t capacity_bytes, size_t step_bytes,
+                      const function<bool()>& stop) override {
+        return inner->set_capacity(capacity_bytes, step_bytes, stop);
+    }
+
+    json stats() const {
+        uint64_t in = bytes_in.load(memory_order_relaxed), out = bytes_out.load(memory_order_relaxed);
+        return {{"min_bytes", min_bytes},
+                {"compressed", compressed.load(memory_order_relaxed)},
+                {"incompressible", skipped.load(memory_order_relaxed)},
+                {"bytes_in", in}, {"bytes_out", out},
+                {"ratio", out ? (double)in / out : 0.0},
+                {"decompressed", inflated.load(memory_order_relaxed)},
+                {"corrupt", corrupt.load(memory_order_relaxed)}};
+    }
+};
+
+// Per-key version stamps, striped over a fixed array of counters. Writers
+// bump a key's stamp once their change is committed; anyone filling the
+// cache from an earlier DB read compares stamps to detect that it raced
+// with a write. Writers bump again after updating the shared cache, so the
+// near caches can trust an unchanged stamp (see NearCache). Keys sharing a
+// stripe only cause spurious mismatches.
+class KeyVersions {
+    static const size_t STRIPES = 1 << 16;
+    unique_ptr<atomic<uint64_t>[]> stamps;
+
+    atomic<uint64_t>& stripe(const string& key) const {
+        return stamps[hash<string>{}(key) & (STRIPES - 1)];
+    }
+
+public:
+    KeyVersions() : stamps(new atomic<uint64_t>[STRIPES]) {
+        for (size_t i = 0; i < STRIPES; i++) stamps[i].store(0, memory_order_relaxed);
+    }
+
+    uint64_t get(const string& key) const { return stripe(key).load(memory_order_acquire); }
+    void bump(const string& key) { stripe(key).fetch_add(1, memory_order_acq_rel); }
+
+    // invalidates every key's stamp at once
+    void bump_all() {
+        for (size_t i = 0; i < STRIPES; i++) stamps[i].fetch_add(1, memory_order_acq_rel);
+    }
+};
+
+// Negative cache: remembers keys the database reported as missing, for a
+// bounded time, so repeated reads of absent keys skip the DB round-trip.
+// Each shard carries a write generation: a reader takes a ticket before
+// querying the DB and its "not found" is only recorded if no write to the
+// shard happened meanwhile, so a concurrent /create is never masked.
+class NegativeCache {
+    typedef chrono::steady_clock::time_point TimePoint;
+
+    struct Shard {
+        mutex mtx;
+        unordered_map<string, TimePoint> expiry;
+        deque<pair<string, TimePoint>> fifo;    // insertion order, for bounding
+        uint64_t generation = 0;
+    };
+
+    vector<unique_ptr<Shard>> shards;
+    chrono::milliseconds ttl;
+    size_t max_per_shard;
+    atomic<uint64_t> hits{0};
+
+    Shard& shard_for(const string& key) const {
+        return *shards[hash<string>{}(key) % shards.size()];
+    }
+
+public:
+    NegativeCache(size_t nshards, chrono::milliseconds ttl_ms, size_t max_entries)
+        : ttl(ttl_ms) {
+        if (nshards == 0) nshards = 1;
+        max_per_shard = max<size_t>(1, max_entries / nshards);
+        for (size_t i = 0; i < nshards; i++) shards.emplace_back(new Shard);
+    }
+
+    bool enabled() const { return ttl.count() > 0; }
+
+    bool contains(const string& key) {
+        if (!enabled()) return false;
+        Shard& s = shard_for(key);
+        lock_guard<mutex> lock(s.mtx);
+        auto it = s.expiry.find(key);
+        if (it == s.expiry.end()) return false;
+        if (it->second <= chrono::steady_clock::now()) {
+            s.expiry.erase(it);
+            return false;
+        }
+        hits.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    uint64_t ticket(const string& key) {
+        if (!enabled()) return 0;
+        Shard& s = shard_for(key);
+        lock_guard<mutex> lock(s.mtx);
+        return s.generation;
+    }
+
+    void insert(const string& key, uint64_t ticket) {
+        if (!enabled()) return;
+        Shard& s = shard_for(key);
+        lock_guard<mutex> lock(s.mtx);
+        if (s.generation != ticket) return;
+
+        TimePoint exp = chrono::steady_clock::now() + ttl;
+        s.expiry[key] = exp;
+        s.fifo.emplace_back(key, exp);
+        while (s.expiry.size() > max_per_shard || s.fifo.size() > 2 * max_per_shard) {
+            auto& old = s.fifo.front();
+            auto it = s.expiry.find(old.first);
+            if (it != s.expiry.end() && it->second == old.second) s.expiry.erase(it);
+            s.fifo.pop_front();
+        }
+    }
+
+    // called after a write to the key has been committed to the DB
+    void invalidate(const string& key) {
+        if (!enabled()) return;
+        Shard& s = shard_for(key);
+        lock_guard<mutex> lock(s.mtx);
+        s.generation++;
+        s.expiry.erase(key);
+    }
+
+    // forgets every key, e.g. after invalidations may have been missed
+    void clear() {
+        for (auto& s : shards) {
+            lock_guard<mutex> lock(s->mtx);
+            s->generation++;
+            s->expiry.clear();
+            s->fifo.clear();
+        }
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for (auto& s : shards) {
+            lock_guard<mutex> lock(s->mtx);
+            n += s->expiry.size();
+        }
+        return n;
+    }
+
+    uint64_t hit_count() const { return hits.load(memory_order_relaxed); }
+};
+
+// Per-thread near cache (L1) in front of the shared cache: a small
+// set-associative table per worker thread, touched by no other thread, so
+// the hottest reads need no lock and no shared writable cache line. Each
+// entry remembers the key's version stamp read before its value was taken
+// from the shared cache and is served only while the stamp is unchanged.
+// For that to be safe, everything that changes or drops a shared-cache
+// entry bumps the key's stamp after doing so (writers bump both before and
+// after, see KeyVersions); a stamp read afterwards therefore guarantees the
+// shared cache already held the newer state.
+class NearCache {
+    static const size_t WAYS = 4;
+    static const size_t MAX_VALUE = 4096;   // larger values stay shared only
+
+    struct Entry {
+        string key;
+        string value;
+        uint64_t stamp = 0;
+        uint64_t last_use = 0;      // 0 = empty
+    };
+
+    struct alignas(64) Counters {
+        atomic<uint64_t> hits{0};
+        atomic<uint64_t> misses{0};
+        atomic<uint64_t> stale{0};
+    };
+
+    struct Table {
+        vector<Entry> entries;
+        uint64_t clock = 0;
+        shared_ptr<Counters> counters;
+    };
+
+    size_t sets;
+    mutable mutex mtx;
+    vector<shared_ptr<Counters>> all_counters;    // one per thread, for metrics
+
+    // sets is fixed at construction, and only one NearCache exists
+    Table& table() {
+        thread_local Table t;
+        if (t.entries.empty()) {
+            t.entries.resize(sets * WAYS);
+            t.counters = make_shared<Counters>();
+            lock_guard<mutex> lock(mtx);
+            all_counters.push_back(t.counters);
+        }
+        return t;
+    }
+
+    Entry* set_of(Table& t, const string& key) {
+        return &t.entries[(hash<string>{}(key) % sets) * WAYS];
+    }
+
+public:
+    NearCache(size_t entries) : sets((entries + WAYS - 1) / WAYS) {}
+
+    bool enabled() const { return sets > 0; }
+
+    // stamp: the key's current version stamp
+    bool get(const string& key, uint64_t stamp, string& value) {
+        if (!enabled()) return false;
+        Table& t = table();
+        Entry* set = set_of(t, key);
+        for (size_t i = 0; i < WAYS; i++) {
+            Entry& e = set[i];
+            if (!e.last_use || e.key != key) continue;
+            if (e.stamp != stamp) {
+                e.last_use = 0;
+                string().swap(e.value);
+                t.counters->stale.fetch_add(1, memory_order_relaxed);
+                break;
+            }
+            e.last_use = ++t.clock;
+            value = e.value;
+            t.counters->hits.fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+        t.counters->misses.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+
+    // stamp: the key's version stamp read before value was fetched
+    void put(const string& key, const string& value, uint64_t stamp) {
+        if (!enabled() || value.size() > MAX_VALUE) return;
+        Table& t = table();
+        Entry* set = set_of(t, key);
+        Entry* victim = &set[0];
+        for (size_t i = 0; i < WAYS; i++) {
+            if (set[i].last_use && set[i].key == key) {
+                victim = &set[i];
+                break;
+            }
+            if (set[i].last_use < victim->last_use) victim = &set[i];
+        }
+        victim->key = key;
+        victim->value = value;
+        victim->stamp = stamp;
+        victim->last_use = ++t.clock;
+    }
+
+    json stats() const {
+        uint64_t hits = 0, misses = 0, stale = 0;
+        lock_guard<mutex> lock(mtx);
+        for (auto& c : all_counters) {
+            hits += c->hits.load(memory_order_relaxed);
+            misses += c->misses.load(memory_order_relaxed);
+            stale += c->stale.load(memory_order_relaxed);
+        }
+        return {{"entries_per_thread", sets * WAYS}, {"threads", all_counters.size()},
+                {"hits", hits}, {"misses", misses}, {"stale", stale}};
+    }
+};
+
+// Online miss ratio curve, estimated with SHARDS spatial sampling: only
+// keys whose (remixed) hash falls below a threshold are tracked, so every
+// access to a sampled key is seen and the sample is a uniform subset of
+// the key space. For each sampled access the LRU stack distance -- bytes of
+// distinct keys touched since the key's previous access -- comes from a
+// Fenwick tree over access times and is scaled up by 1 / sampling rate.
+// The distance histogram then gives the hit ratio an LRU cache of any size
+// would have had on the same traffic. The tracked set is bounded: past
+// max_keys the key with the highest hash is dropped and the threshold
+// lowered to it (fixed-size SHARDS), which also lowers the rate. Every
+// access also adds the current rate to a per-thread sum, the number of
+// sampled accesses expected; the shortfall of actual ones (the few hottest
+// keys missing from the sample) is credited as hits (SHARDS_adj).
+class MissRatioCurve {
+    static const size_t BINS_PER_DOUBLING = 4;
+    static const size_t MIN_BYTES_LOG2 = 12;            // first bin ends at 4 KiB
+    static const size_t BINS = 40 * BINS_PER_DOUBLING;  // last ends at 4 PiB
+    static const size_t ENTRY_OVERHEAD = 64;            // rough metadata per entry
+
+    struct Tracked {
+        uint32_t time;
+        uint32_t bytes;
+    };
+
+    // sum of sampling rates over a thread's accesses, in units of 2^-24
+    struct alignas(64) Expected {
+        atomic<uint64_t> units{0};
+    };
+
+    atomic<uint64_t> threshold;         // sample keys with hash < threshold
+    size_t max_keys;
+    mutable mutex mtx;
+    map<uint64_t, Tracked> keys;        // ordered, to find the highest hash
+    vector<uint64_t> tree;              // Fenwick tree of bytes by last access time
+    uint32_t now = 0;
+    vector<uint64_t> histogram = vector<uint64_t>(BINS, 0);
+    uint64_t cold = 0;                  // first accesses, misses at any size
+    vector<shared_ptr<Expected>> expected;  // one per thread
+
+    Expected& my_expected() {
+        thread_local shared_ptr<Expected> e;
+        if (!e) {
+            e = make_shared<Expected>();
+            lock_guard<mutex> lock(mtx);
+            expected.push_back(e);
+        }
+        return *e;
+    }
+
+    static uint64_t mix(const string& key) {
+        uint64_t h = hash<string>{}(key) + 0x9e3779b97f4a7c15ull;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+        return h ^ (h >> 31);
+    }
+
+    void tree_add(size_t t, int64_t delta) {
+        for (; t < tree.size(); t += t & -t) tree[t] += delta;
+    }
+    uint64_t tree_prefix(size_t t) const {
+        uint64_t sum = 0;
+        for (; t > 0; t -= t & -t) sum += tree[t];
+        return sum;
+    }
+
+    double rate() const { return threshold.load(memory_order_relaxed) / 18446744073709551616.0; }
+
+    // the tree has run out of times: renumber keys by last access, keeping order
+    void compact() {
+        vector<pair<uint32_t, Tracked*>> order;
+        for (auto& kv : keys) order.emplace_back(kv.second.time, &kv.second);
+        sort(order.begin(), order.end(), [](const pair<uint32_t, Tracked*>& a,
+                                            const pair<uint32_t, Tracked*>& b) {
+            return a.first < b.first;
+        });
+        fill(tree.begin(), tree.end(), 0);
+        now = 0;
+        for (auto& o : order) {
+            o.second->time = ++now;
+            tree_add(now, o.second->bytes);
+        }
+    }
+
+    static size_t bin_for(double bytes) {
+        if (bytes <= (double)(1ull << MIN_BYTES_LOG2)) return 0;
+        double b = ceil(BINS_PER_DOUBLING * (log2(bytes) - MIN_BYTES_LOG2));
+        return min<size_t>(BINS - 1, (size_t)b);
+    }
+
+    static double bin_bytes(size_t bin) {
+        return ldexp(1.0, MIN_BYTES_LOG2) * exp2((double)bin / BINS_PER_DOUBLING);
+    }
+
+public:
+    MissRatioCurve(double sample_rate, size_t max_keys)
+        : max_keys(max<size_t>(1, max_keys)), tree(2 * this->max_keys + 2, 0) {
+        double r = min(1.0, max(0.0, sample_rate));
+        threshold.store(r >= 1.0 ? UINT64_MAX : (uint64_t)(r * 18446744073709551616.0));
+    }
+
+    bool enabled() const { return threshold.load(memory_order_relaxed) > 0; }
+
+    // an access that leaves key cached with a value of value_bytes
+    void access(const string& key, size_t value_bytes) {
+        if (!enabled()) return;
+        uint64_t t = threshold.load(memory_order_relaxed);
+        Expected& e = my_expected();
+        e.units.store(e.units.load(memory_order_relaxed) + (t >> 40), memory_order_relaxed);
+        uint64_t h = mix(key);
+        if (h >= t) return;
+        uint32_t bytes = (uint32_t)min<size_t>(UINT32_MAX, key.size() + value_bytes + ENTRY_OVERHEAD);
+
+        lock_guard<mutex> lock(mtx);
+        if (h >= threshold.load(memory_order_relaxed)) return;
+        if (now + 1 >= tree.size()) compact();
+
+        auto it = keys.find(h);
+        if (it == keys.end()) {
+            cold++;
+            it = keys.emplace(h, Tracked{0, bytes}).first;
+        } else {
+            uint64_t between = tree_prefix(now) - tree_prefix(it->second.time);
+            tree_add(it->second.time, -(int64_t)it->second.bytes);
+            histogram[bin_for(between / rate() + bytes)]++;
+            it->second.bytes = bytes;
+        }
+        it->second.time = ++now;
+        tree_add(now, bytes);
+
+        if (keys.size() > max_keys) {
+            auto last = prev(keys.end());
+            tree_add(last->second.time, -(int64_t)last->second.bytes);
+            threshold.store(last->first, memory_order_relaxed);
+            keys.erase(last);
+        }
+    }
+
+    // the key was deleted: its next access is a cold miss
+    void forget(const string& key) {
+        uint64_t h = mix(key);
+        if (h >= threshold.load(memory_order_relaxed)) return;
+        lock_guard<mutex> lock(mtx);
+        auto it = keys.find(h);
+        if (it == keys.end()) return;
+        tree_add(it->second.time, -(int64_t)it->second.bytes);
+        keys.erase(it);
+    }
+
+    // curve points up to the largest observed distance, plus the estimate
+    // at capacity_bytes
+    json curve(size_t capacity_bytes) const {
+        lock_guard<mutex> lock(mtx);
+        uint64_t sampled = cold;
+        size_t last = 0;
+        for (size_t b = 0; b < BINS; b++) {
+            sampled += histogram[b];
+            if (histogram[b]) last = b;
+        }
+        double total = 0;
+        for (auto& e : expected) total += e->units.load(memory_order_relaxed);
+        total = max(total / (1 << 24), (double)sampled);
+
+        json points = json::array();
+        double hits = total - sampled;      // hot keys the sample missed
+        double hits_at_capacity = 0;
+        for (size_t b = 0; b < BINS && sampled; b++) {
+            hits += histogram[b];
+            if (bin_bytes(b) <= capacity_bytes) hits_at_capacity = hits;
+            if (b <= last + 1)
+                points.push_back({{"cache_bytes", (uint64_t)bin_bytes(b)},
+                                  {"hit_ratio", hits / total}});
+        }
+        return {{"sample_rate", rate()}, {"tracked_keys", keys.size()},
+                {"sampled_accesses", sampled}, {"expected_sampled", total},
+                {"cold_misses", cold}, {"capacity_bytes", capacity_bytes},
+                {"hit_ratio_at_capacity", sampled ? hits_at_capacity / total : 0.0},
+                {"curve", points}};
+    }
+};
+
+// Heavy-hitter tracking for hot-key detection: a Space-Saving sketch of
+// fixed size over a 1-in-sample_every sample of /read and /create accesses
+// (a per-thread countdown, so unsampled accesses cost a decrement). A
+// sampled access that finds the sketch locked is dropped rather than wait.
+// Counts are kept per window; the endpoint reports the last complete
+// window, or the current one until the first completes. A key's count
+// overestimates by at most its error (the count it inherited on entry).
+class HotKeys {
+public:
+    enum Kind { HIT, MISS, WRITE };
+
+private:
+    struct Counter {
+        string key;
+        uint64_t count = 0;
+        uint64_t error = 0;
+        uint64_t by_kind[3] = {0, 0, 0};
+    };
+
+    size_t capacity;
+    uint32_t sample_every;
+    chrono::seconds window;
+    mutable mutex mtx;
+    vector<Counter> heap;                   // min-heap on count
+    unordered_map<string, size_t> where;    // key -> heap position
+    chrono::steady_clock::time_point window_start;
+    vector<Counter> last_window;            // sorted by count, descending
+    chrono::duration<double> last_length{0};
+
+    void swap_nodes(size_t a, size_t b) {
+        swap(heap[a], heap[b]);
+        where[heap[a].key] = a;
+        where[heap[b].key] = b;
+    }
+
+    // count at i grew: move it below smaller children
+    void sift_down(size_t i) {
+        while (true) {
+            size_t l = 2 * i + 1, r = l + 1, m = i;
+            if (l < heap.size() && heap[l].count < heap[m].count) m = l;
+            if (r < heap.size() && heap[r].count < heap[m].count) m = r;
+            if (m == i) return;
+            swap_nodes(i, m);
+            i = m;
+        }
+    }
+
+    void sift_up(size_t i) {
+        while (i > 0 && heap[(i - 1) / 2].count > heap[i].count) {
+            swap_nodes(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void rotate_if_due(chrono::steady_clock::time_point now) {
+        if (now - window_start < window) return;
+        last_window = heap;
+        sort(last_window.begin(), last_window.end(),
+             [](const Counter& a, const Counter& b) { return a.count > b.count; });
+        last_length = now - window_start;
+        heap.clear();
+        where.clear();
+        window_start = now;
+    }
+
+public:
+    HotKeys(size_t capacity, uint32_t sample_every, chrono::seconds window)
+        : capacity(capacity), sample_every(max<uint32_t>(1, sample_every)),
+          window(max<chrono::seconds>(chrono::seconds(1), window)),
+          window_start(chrono::steady_clock::now()) {}
+
+    bool enabled() const { return capacity > 0; }
+
+    void record(const string& key, Kind kind) {
+        if (!enabled()) return;
+        thread_local uint32_t countdown = 0;
+        if (countdown-- > 0) return;
+        countdown = sample_every - 1;
+
+        unique_lock<mutex> lock(mtx, try_to_lock);
+        if (!lock.owns_lock()) return;
+        rotate_if_due(chrono::steady_clock::now());
+
+        auto it = where.find(key);
+        size_t i;
+        if (it != where.end()) {
+            i = it->second;
+        } else if (heap.size() < capacity) {
+            // a new counter holds the smallest count, so it only moves up
+            i = heap.size();
+            heap.emplace_back();
+            heap[i].key = key;
+            heap[i].count = 1;
+            heap[i].by_kind[kind] = 1;
+            where[key] = i;
+            sift_up(i);
+            return;
+        } else {
+            // replace the minimum, inheriting its count as the error bound
+            i = 0;
+            where.erase(heap[0].key);
+            heap[0].key = key;
+            heap[0].error = heap[0].count;
+            heap[0].by_kind[HIT] = heap[0].by_kind[MISS] = heap[0].by_kind[WRITE] = 0;
+            where[key] = 0;
+        }
+        heap[i].count++;
+        heap[i].by_kind[kind]++;
+        sift_down(i);
+    }
+
+    json top(size_t k) {
+        lock_guard<mutex> lock(mtx);
+        rotate_if_due(chrono::steady_clock::now());
+        vector<Counter> current;
+        const vector<Counter>* src = &last_window;
+        double seconds = last_length.count();
+        if (last_window.empty()) {
+            current = heap;
+            sort(current.begin(), current.end(),
+                 [](const Counter& a, const Counter& b) { return a.count > b.count; });
+            src = &current;
+            seconds = chrono::duration<double>(chrono::steady_clock::now() - window_start).count();
+        }
+
+        json keys = json::array();
+        for (size_t i = 0; i < src->size() && i < k; i++) {
+            const Counter& c = (*src)[i];
+            keys.push_back({{"key", c.key},
+                            {"accesses", c.count * sample_every},
+                            {"rate_per_s", seconds > 0 ? c.count * sample_every / seconds : 0.0},
+                            {"hits", c.by_kind[HIT] * sample_every},
+                            {"misses", c.by_kind[MISS] * sample_every},
+                            {"writes", c.by_kind[WRITE] * sample_every},
+                            {"error", c.error * sample_every}});
+        }
+        return {{"window_s", seconds}, {"sample_every", sample_every}, {"keys", keys}};
+    }
+};
+
+// Flash second tier: entries evicted from memory are appended to a
+// log-structured file on local SSD, and memory misses look there before
+// going to Postgres. The file is a ring of fixed-size segments. Records
+// ([u32 klen][u32 vlen][key][value]) are packed into the active segment's
+// aligned buffer. A full buffer is sealed and written by a background
+// thread with one sequential O_DIRECT pwrite; the thread then reclaims the
+// next segment in the ring, the oldest data, by dropping its index
+// entries. The in-memory index maps a key's 64-bit hash to the record's
+// location and the key's KeyVersions stamp at eviction. A hit needs the
+// current stamp, so writes, deletes, TTL expiry and peer invalidations,
+// which all bump it, retire flash copies without touching the file. Reads
+// of written segments are aligned direct preads, checked against a
+// per-segment generation in case the segment was reclaimed meanwhile.
+// Evictions that arrive while the writer is still busy are dropped rather
+// than block the shard lock they come from.
+class FlashTier {
+    static constexpr size_t ALIGN = 4096;
+    static constexpr size_t HEADER = 2 * sizeof(uint32_t);
+
+    struct Loc {
+        uint32_t segment;
+        uint32_t offset;
+        uint32_t length;
+        uint64_t stamp;
+        uint64_t generation;
+    };
+
+    struct Buffer {
+        char* data = nullptr;
+        uint32_t segment = 0;
+        size_t used = 0;
+    };
+
+    string path;
+    size_t segment_bytes;
+    uint32_t segments;
+    int fd = -1;
+    bool direct = false;
+
+    mutable mutex mtx;
+    condition_variable sealed_cv;
+    FlatIndex<Loc> index;                   // keyed by the 8 bytes of the hash
+    vector<vector<uint64_t>> segment_keys;  // hashes written to each segment
+    unique_ptr<atomic<uint64_t>[]> generation;
+    Buffer active, sealed;
+    bool sealed_pending = false;
+    bool next_ready = true;                 // segment after active is reclaimed
+
+    atomic<uint64_t> hits{0}, misses{0}, stale{0}, dropped{0}, written{0}, io_errors{0};
+
+    static string_view hash_key(const uint64_t& h) {
+        return string_view(reinterpret_cast<const char*>(&h), sizeof(h));
+    }
+
+    static char* aligned_buffer(size_t bytes) {
+        void* p = nullptr;
+        if (posix_memalign(&p, ALIGN, bytes) != 0) throw bad_alloc();
+        return static_cast<char*>(p);
+    }
+
+    static bool parse(const char* rec, size_t length, const string& key, string& value) {
+        uint32_t klen, vlen;
+        memcpy(&klen, rec, sizeof(klen));
+        memcpy(&vlen, rec + sizeof(klen), sizeof(vlen));
+        if (klen != key.size() || HEADER + klen + vlen != length) return false;
+        if (memcmp(rec + HEADER, key.data(), klen) != 0) return false;
+        value.assign(rec + HEADER + klen, vlen);
+        return true;
+    }
+
+    // drops the index entries of a segment about to be overwritten; a read
+    // already in flight on it sees the generation change
+    void reclaim(uint32_t seg) {
+        generation[seg].fetch_add(1);
+        for (uint64_t h : segment_keys[seg]) {
+            Loc* l = index.find(hash_key(h));
+            if (l && l->segment == seg) index.erase(hash_key(h));
+        }
+        segment_keys[seg].clear();
+    }
+
+    void write_loop() {
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            sealed_cv.wait(lock, [this] { return sealed_pending; });
+            Buffer b = sealed;
+            lock.unlock();
+            ssize_t n = pwrite(fd, b.data, segment_bytes, (off_t)b.segment * segment_bytes);
+            lock.lock();
+            if (n != (ssize_t)segment_bytes) {
+                io_errors.fetch_add(1, memory_order_relaxed);
+                reclaim(b.segment);
+            } else {
+                written.fetch_add(segment_bytes, memory_order_relaxed);
+            }
+            sealed_pending = false;
+            reclaim((active.segment + 1) % segments);
+            next_ready = true;
+        }
+    }
+
+    // per-thread aligned buffer for direct reads
+    static char* read_buffer(size_t bytes) {
+        thread_local unique_ptr<char, decltype(&free)> buf(nullptr, &free);
+        thread_local size_t size = 0;
+        if (size < bytes) {
+            buf.reset(aligned_buffer(bytes));
+            size = bytes;
+        }
+        return buf.get();
+    }
+
+public:
+    FlashTier(const string& path, size_t capacity_bytes, size_t segment_bytes)
+        : path(path),
+          segment_bytes(max(ALIGN, (segment_bytes + ALIGN - 1) & ~(ALIGN - 1))) {
+        segments = (uint32_t)max<size_t>(4, capacity_bytes / this->segment_bytes);
+    }
+
+    // creates (truncates) the file and starts the writer; false on error
+    bool start() {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        direct = fd >= 0;
+        if (fd < 0 && errno == EINVAL)      // e.g. tmpfs: buffered IO instead
+            fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        if (ftruncate(fd, (off_t)segments * segment_bytes) != 0) return false;
+
+        segment_keys.resize(segments);
+        generation.reset(new atomic<uint64_t>[segments]);
+        for (uint32_t i = 0; i < segments; i++) generation[i].store(0);
+        active.data = aligned_buffer(segment_bytes);
+        sealed.data = aligned_buffer(segment_bytes);
+        active.segment = 0;
+        thread([this] { write_loop(); }).detach();
+        return true;
+    }
+
+    // an entry left memory; stamp is the key's current version stamp
+    void stage(const string& key, const string& value, uint64_t stamp) {
+        size_t length = HEADER + key.size() + value.size();
+        if (length > segment_bytes) return;
+        uint64_t h = hash<string>{}(key);
+
+        lock_guard<mutex> lock(mtx);
+        if (active.used + length > segment_bytes) {
+            if (sealed_pending || !next_ready) {
+                dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+            swap(active, sealed);
+            sealed_pending = true;
+            active.segment = (sealed.segment + 1) % segments;
+            active.used = 0;
+            next_ready = false;
+            sealed_cv.notify_one();
+        }
+
+        char* rec = active.data + active.used;
+        uint32_t klen = key.size(), vlen = value.size();
+        memcpy(rec, &klen, sizeof(klen));
+        memcpy(rec + sizeof(klen), &vlen, sizeof(vlen));
+        memcpy(rec + HEADER, key.data(), klen);
+        memcpy(rec + HEADER + klen, value.data(), vlen);
+
+        Loc loc = { active.segment, (uint32_t)active.used, (uint32_t)length, stamp,
+                    generation[active.segment].load() };
+        auto ins = index.insert(hash_key(h), loc);
+        if (!ins.second) *ins.first = loc;
+        segment_keys[active.segment].push_back(h);
+        active.used += length;
+    }
+
+    // stamp: the key's version stamp, read before looking
+    bool get(const string& key, uint64_t stamp, string& value) {
+        uint64_t h = hash<string>{}(key);
+        Loc loc;
+        {
+            lock_guard<mutex> lock(mtx);
+            Loc* l = index.find(hash_key(h));
+            if (!l || l->stamp != stamp) {
+                if (l) {
+                    index.erase(hash_key(h));
+                    stale.fetch_add(1, memory_order_relaxed);
+                }
+                misses.fetch_add(1, memory_order_relaxed);
+                return false;
+            }
+            loc = *l;
+            const Buffer* mem = nullptr;
+            if (loc.segment == active.segment) mem = &active;
+            else if (sealed_pending && loc.segment == sealed.segment) mem = &sealed;
+            if (mem) {
+                bool ok = parse(mem->data + loc.offset, loc.length, key, value);
+                (ok ? hits : misses).fetch_add(1, memory_order_relaxed);
+                return ok;
+            }
+        }
+
+        size_t pos = (size_t)loc.segment * segment_bytes + loc.offset;
+        size_t start = pos & ~(ALIGN - 1);
+        size_t end = (pos + loc.length + ALIGN - 1) & ~(ALIGN - 1);
+        char* buf = read_buffer(end - start);
+        ssize_t n = pread(fd, buf, end - start, start);
+        bool ok = n >= (ssize_t)(pos + loc.length - start) &&
+                  generation[loc.segment].load() == loc.generation &&
+                  parse(buf + (pos - start), loc.length, key, value);
+        if (n < 0) io_errors.fetch_add(1, memory_order_relaxed);
+        (ok ? hits : misses).fetch_add(1, memory_order_relaxed);
+        return ok;
+    }
+
+    json stats() const {
+        lock_guard<mutex> lock(mtx);
+        return {{"path", path}, {"direct_io", direct},
+                {"capacity_bytes", (uint64_t)segments * segment_bytes},
+                {"entries", index.size()}, {"index_bytes", index.memory_bytes()},
+                {"hits", hits.load(memory_order_relaxed)},
+                {"misses", misses.load(memory_order_relaxed)},
+                {"stale", stale.load(memory_order_relaxed)},
+                {"dropped", dropped.load(memory_order_relaxed)},
+                {"written_bytes", written.load(memory_order_relaxed)},
+                {"io_errors", io_errors.load(memory_order_relaxed)}};
+    }
+};
+
+// Postgres Database setup
+static const char* DB_CONNINFO =
+    "host=localhost port=5432 user=postgres password=postgres dbname=kvdb";
+
+// Set before the first connection when peer invalidation is on: every
+// connection tags its session with it, and the kv_store trigger includes
+// it in notifications so a server can skip its own writes
+static std::string db_instance_tag;
+
+// Binary wire format: parameters and results travel in Postgres' binary
+// representation (big-endian integers, raw bytea), so nothing is printed
+// or parsed as text on either side and values may hold any bytes.
+static const Oid PG_BYTEA = 17, PG_INT8 = 20, PG_INT4 = 23;
+static const Oid PG_BYTEA_ARRAY = 1001, PG_INT8_ARRAY = 1016;
+static const int PG_BINARY = 1;
+
+static std::string pg_int8(int64_t v) {
+    uint64_t be = htobe64((uint64_t)v);
+    return std::string(reinterpret_cast<const char*>(&be), sizeof(be));
+}
+
+static std::string pg_int4(int32_t v) {
+    uint32_t be = htobe32((uint32_t)v);
+    return std::string(reinterpret_cast<const char*>(&be), sizeof(be));
+}
+
+static int64_t pg_get_int8(const PGresult* res, int row, int col) {
+    uint64_t be;
+    memcpy(&be, PQgetvalue(res, row, col), sizeof(be));
+    return (int64_t)be64toh(be);
+}
+
+// one-dimensional array of already binary-encoded elements
+static std::string pg_binary_array(Oid element_type, const std::vector<std::string>& items) {
+    std::string out = pg_int4(items.empty() ? 0 : 1) + pg_int4(0) + pg_int4((int32_t)element_type);
+    if (items.empty()) return out;
+    out += pg_int4((int32_t)items.size()) + pg_int4(1);
+    for (auto& item : items) {
+        out += pg_int4((int32_t)item.size());
+        out += item;
+    }
+    return out;
+}
+
+// Hot-path statements, prepared on every connection as it opens so each
+// request only binds parameters instead of having Postgres parse and plan
+// the SQL again. Run them with db_exec_prepared.
+enum DbStatementId { STMT_CREATE, STMT_CREATE_TTL, STMT_READ, STMT_DELETE, STMT_COUNT };
+
+struct DbStatement {
+    const char* name;
+    const char* sql;
+    int params;
+    Oid types[3];
+};
+
+static const DbStatement DB_STATEMENTS[STMT_COUNT] = {
+    { "kv_create",
+      "INSERT INTO kv_store(\"key\", value) VALUES ($1, $2) "
+      "ON CONFLICT (\"key\") DO UPDATE SET value = EXCLUDED.value, expires_at = NULL",
+      2, { PG_INT8, PG_BYTEA } },
+    { "kv_create_ttl",
+      "INSERT INTO kv_store(\"key\", value, expires_at) "
+      "VALUES ($1, $2, now() + $3 * interval '1 second') "
+      "ON CONFLICT (\"key\") DO UPDATE SET value = EXCLUDED.value, "
+      "expires_at = EXCLUDED.expires_at",
+      3, { PG_INT8, PG_BYTEA, PG_INT4 } },
+    { "kv_read",
+      "SELECT value, (extract(epoch from expires_at - now()) * 1000)::bigint "
+      "FROM kv_store WHERE \"key\" = $1 "
+      "AND (expires_at IS NULL OR expires_at > now())",
+      1, { PG_INT8 } },
+    { "kv_delete",
+      "DELETE FROM kv_store WHERE \"key\" = $1",
+      1, { PG_INT8 } },
+};
+
+static bool db_prepare(PGconn* conn, const DbStatement& stmt) {
+    PGresult* res = PQprepare(conn, stmt.name, stmt.sql, stmt.params, stmt.types);
+    bool ok = res && PQresultStatus(res) == PGRES_COMMAND_OK;
+    if (!ok) cerr << "[DB] Could not prepare " << stmt.name << ": " << PQerrorMessage(conn) << "\n";
+    if (res) PQclear(res);
+    return ok;
+}
+
+static void db_prepare_all(PGconn* conn) {
+    for (const DbStatement& stmt : DB_STATEMENTS) db_prepare(conn, stmt);
+}
+
+// Runs a prepared statement with binary parameters (lengths[i] bytes each)
+// and a binary result. A statement missing on this connection (its prepare
+// failed, e.g. before db_ensure_schema added expires_at) is prepared and
+// the call retried once.
+PGresult* db_exec_prepared(PGconn* conn, DbStatementId id, const char* const* params,
+                           const int* lengths) {
+    static const int formats[3] = { PG_BINARY, PG_BINARY, PG_BINARY };
+    const DbStatement& stmt = DB_STATEMENTS[id];
+    PGresult* res = PQexecPrepared(conn, stmt.name, stmt.params, params, lengths, formats, PG_BINARY);
+    const char* state = res ? PQresultErrorField(res, PG_DIAG_SQLSTATE) : nullptr;
+    if (state && strcmp(state, "26000") == 0) {     // invalid_sql_statement_name
+        PQclear(res);
+        if (!db_prepare(conn, stmt)) return nullptr;
+        res = PQexecPrepared(conn, stmt.name, stmt.params, params, lengths, formats, PG_BINARY);
+    }
+    return res;
+}
+
+// tags the session so peer-invalidation triggers can tell whose write it was
+static const char* DB_TAG_SQL = "SELECT set_config('kvserver.instance', $1, false)";
+
+PGconn* open_connection() {
+    PGconn* conn = PQconnectdb(DB_CONNINFO);
+    if (conn && PQstatus(conn) == CONNECTION_OK && !db_instance_tag.empty()) {
+        const char* params[1] = { db_instance_tag.c_str() };
+        PGresult* res = PQexecParams(conn, DB_TAG_SQL, 1, nullptr, params, nullptr, nullptr, 0);
+        if (!res || PQresultStatus(res) != PGRES_TUPLES_OK)
+            cerr << "[DB] Could not tag connection: " << PQerrorMessage(conn) << "\n";
+        if (res) PQclear(res);
+    }
+    if (conn && PQstatus(conn) == CONNECTION_OK) db_prepare_all(conn);
+    return conn;
+}
+
+// Shared, bounded pool of Postgres connections. Callers borrow one for the
+// duration of a query (see get_connection) instead of each thread keeping
+// its own, so many HTTP threads can share a few backends. The pool opens up
+// to max_size connections on demand and pre-opens min_size at startup.
+// When all are busy, callers queue in FIFO order and each released
+// connection goes straight to the longest waiter; a caller still waiting
+// after the timeout gets no connection. A connection that dropped, or is
+// left inside a transaction, is closed on release and its slot passed on.
+// Connections idle for a while are pinged before being handed out.
+class ConnectionPool {
+    typedef chrono::steady_clock Clock;
+
+    struct Idle {
+        PGconn* conn;
+        Clock::time_point since;
+    };
+
+    // a queued caller; granted with conn == nullptr means "open a new one"
+    struct Waiter {
+        condition_variable cv;
+        PGconn* conn = nullptr;
+        bool granted = false;
+    };
+
+    size_t min_size, max_size;
+    chrono::milliseconds timeout;
+
+    mutable mutex mtx;
+    vector<Idle> idle;              // most recently used last
+    deque<Waiter*> waiters;
+    size_t total = 0;               // open or being opened
+    size_t in_use = 0;
+    size_t max_waiting = 0;
+    uint64_t acquires = 0, waited = 0, timeouts = 0, created = 0, discarded = 0, failed = 0;
+    chrono::nanoseconds wait_time{0};
+
+    static bool usable(PGconn* c) { return c && PQstatus(c) == CONNECTION_OK; }
+
+    static bool ping(PGconn* c) {
+        PGresult* res = PQexec(c, "SELECT 1");
+        bool ok = res && PQresultStatus(res) == PGRES_TUPLES_OK;
+        if (!ok) cerr << "[PG] Ping failed, reconnecting: " << PQerrorMessage(c) << endl;
+        if (res) PQclear(res);
+        return ok;
+    }
+
+    // called with mtx held: hands conn (or its free slot) to the next waiter
+    void pass_on(PGconn* conn) {
+        if (!waiters.empty()) {
+            Waiter* w = waiters.front();
+            waiters.pop_front();
+            w->conn = conn;
+            w->granted = true;
+            w->cv.notify_one();
+        } else if (conn) {
+            idle.push_back({conn, Clock::now()});
+        } else {
+            total--;
+        }
+    }
+
+public:
+    class Lease {
+        ConnectionPool* pool = nullptr;
+        PGconn* conn = nullptr;
+    public:
+        Lease() {}
+        Lease(ConnectionPool* pool, PGconn* conn) : pool(pool), conn(conn) {}
+        Lease(Lease&& o) : pool(o.pool), conn(o.conn) { o.conn = nullptr; }
+        Lease& operator=(Lease&& o) {
+            swap(pool, o.pool);
+            swap(conn, o.conn);
+            return *this;
+        }
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease() { if (conn) pool->release(conn); }
+        operator PGconn*() const { return conn; }
+    };
+
+    ConnectionPool(size_t min_size, size_t max_size, chrono::milliseconds timeout)
+        : min_size(min(min_size, max(max_size, (size_t)1))),
+          max_size(max(max_size, (size_t)1)), timeout(timeout) {}
+
+    // opens min_size connections; returns how many succeeded
+    size_t prewarm() {
+        vector<Lease> leases;
+        for (size_t i = 0; i < min_size; i++) {
+            Lease l = acquire();
+            if (!l) break;
+            leases.push_back(move(l));
+        }
+        return leases.size();
+    }
+
+    // a connection, or an empty lease if none could be had within the timeout
+    Lease acquire() {
+        auto start = Clock::now();
+        PGconn* conn = nullptr;
+        bool fresh = false;     // handed over directly, no need to ping
+        {
+            unique_lock<mutex> lock(mtx);
+            acquires++;
+            if (waiters.empty() && !idle.empty()) {
+                Idle i = idle.back();
+                idle.pop_back();
+                conn = i.conn;
+                fresh = Clock::now() - i.since < chrono::seconds(5);
+            } else if (waiters.empty() && total < max_size) {
+                total++;
+            } else {
+                Waiter w;
+                waiters.push_back(&w);
+                waited++;
+                max_waiting = max(max_waiting, waiters.size());
+                if (!w.cv.wait_until(lock, start + timeout, [&] { return w.granted; })) {
+                    waiters.erase(find(waiters.begin(), waiters.end(), &w));
+                    timeouts++;
+                    wait_time += Clock::now() - start;
+                    return Lease();
+                }
+                wait_time += Clock::now() - start;
+                conn = w.conn;
+                fresh = true;
+            }
+            in_use++;
+        }
+
+        if (conn && !(usable(conn) && (fresh || ping(conn)))) {
+            PQfinish(conn);
+            conn = nullptr;
+            lock_guard<mutex> lock(mtx);
+            discarded++;
+        }
+        if (!conn) {            // holding a free slot: open a connection for it
+            conn = open_connection();
+            if (!usable(conn)) {
+                cerr << "PostgreSQL connection failed: "
+                     << (conn ? PQerrorMessage(conn) : "(null)") << endl;
+                if (conn) PQfinish(conn);
+                lock_guard<mutex> lock(mtx);
+                failed++;
+                in_use--;
+                pass_on(nullptr);
+                return Lease();
+            }
+            lock_guard<mutex> lock(mtx);
+            created++;
+        }
+        return Lease(this, conn);
+    }
+
+    void release(PGconn* conn) {
+        if (!usable(conn) || PQtransactionStatus(conn) != PQTRANS_IDLE) {
+            PQfinish(conn);
+            conn = nullptr;
+        }
+        lock_guard<mutex> lock(mtx);
+        if (!conn) discarded++;
+        in_use--;
+        pass_on(conn);
+    }
+
+    json stats() const {
+        lock_guard<mutex> lock(mtx);
+        return {{"min", min_size}, {"max", max_size}, {"open", total},
+                {"idle", idle.size()}, {"in_use", in_use},
+                {"utilization", (double)in_use / max_size},
+                {"waiting", waiters.size()}, {"max_waiting", max_waiting},
+                {"acquires", acquires}, {"waited", waited}, {"timeouts", timeouts},
+                {"wait_ms_total", chrono::duration_cast<chrono::milliseconds>(wait_time).count()},
+                {"created", created}, {"discarded", discarded}, {"connect_failures", failed}};
+    }
+};
+
+static unique_ptr<ConnectionPool> db_pool;
+
+// Borrows a pooled connection for the caller's scope; empty (converts to
+// nullptr) when none is available
+ConnectionPool::Lease get_connection() {
+    return db_pool->acquire();
+}
+
+// Asynchronous, pipelined DB access: one event loop thread drives a set of
+// non-blocking connections in libpq pipeline mode through epoll. Callers
+// submit a prepared statement with a completion callback and return at
+// once; the loop spreads queued statements over the least busy connections,
+// keeping up to `depth` in flight on each without waiting for earlier
+// results, and runs each callback, on the loop thread, as its result
+// arrives. Each statement is followed by its own sync point, so it runs in
+// its own implicit transaction and one failing statement doesn't abort the
+// others. With Postgres on another host this replaces one round-trip per
+// query with one per batch, and the number of outstanding queries is no
+// longer tied to the number of threads waiting on them. exec() is the
+// blocking form for code that runs on its own thread. Connects and
+// reconnects (with backoff) are non-blocking handshakes on the same loop.
+class DbPipeline {
+public:
+    // receives the (binary) result, or nullptr if the connection failed;
+    // runs on the loop thread and must not block
+    typedef function<void(PGresult*)> Callback;
+
+private:
+    struct Request {
+        DbStatementId stmt;
+        vector<string> params;
+        Callback done;
+        PGresult* result = nullptr;
+        chrono::steady_clock::time_point deadline;  // for leaving the queue
+    };
+
+    struct Connection {
+        PGconn* conn = nullptr;
+        int fd = -1;                // socket registered with epoll
+        uint32_t events = 0;        // what fd is registered for
+        bool connecting = false;    // handshake still in PQconnectPoll
+        bool want_write = false;
+        int setup = 0;              // session setup syncs still to arrive
+        deque<unique_ptr<Request>> inflight;
+        chrono::steady_clock::time_point retry_at, connect_deadline;
+        chrono::milliseconds backoff{100};
+    };
+
+    // a handshake that hasn't finished by then is abandoned and retried
+    static constexpr chrono::seconds CONNECT_TIMEOUT{5};
+
+    vector<Connection> conns;
+    size_t depth;
+    chrono::milliseconds queue_timeout;
+    int epoll_fd = -1;
+    int wake_fd = -1;               // eventfd, signalled when the queue grows
+
+    mutex mtx;                      // guards queue
+    deque<unique_ptr<Request>> queue;
+    atomic<size_t> connections_up{0}, connecting_now{0};
+    atomic<size_t> inflight_now{0}, queued_now{0};
+    atomic<uint64_t> submitted{0}, failed{0}, reconnects{0}, timeouts{0};
+    atomic<size_t> max_inflight{0};
+
+    void finish(unique_ptr<Request> r, PGresult* res) {
+        if (!res) failed.fetch_add(1, memory_order_relaxed);
+        r->done(res);
+    }
+
+    // (re)registers c's socket with epoll; libpq may switch sockets while
+    // connecting, and a reused descriptor number needs ADD rather than MOD
+    void watch(Connection& c, uint32_t events) {
+        int fd = PQsocket(c.conn);
+        if (fd == c.fd && events == c.events) return;
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u32 = &c - conns.data();
+        int op = fd == c.fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (op == EPOLL_CTL_ADD && c.fd >= 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.fd, nullptr);
+        if (fd >= 0 && epoll_ctl(epoll_fd, op, fd, &ev) != 0)
+            epoll_ctl(epoll_fd, op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+        c.fd = fd;
+        c.events = events;
+    }
+
+    // closes c and schedules the next attempt
+    void reset(Connection& c) {
+        if (c.fd >= 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.fd, nullptr);
+        if (c.conn) PQfinish(c.conn);
+        c.conn = nullptr;
+        c.fd = -1;
+        c.events = 0;
+        c.retry_at = chrono::steady_clock::now() + c.backoff;
+        c.backoff = min(c.backoff * 2, chrono::milliseconds(5000));
+    }
+
+    void drop(Connection& c) {
+        if (!c.conn) return;
+        if (c.connecting) {
+            c.connecting = false;
+            connecting_now--;
+        } else {
+            connections_up--;
+        }
+        for (auto& r : c.inflight) {
+            if (r->result) PQclear(r->result);
+            inflight_now--;
+            finish(move(r), nullptr);
+        }
+        c.inflight.clear();
+        reset(c);
+    }
+
+    // starts a non-blocking connect; advance() carries the handshake on as
+    // the socket becomes ready, so an unreachable server never holds up the
+    // loop or the other connections
+    void begin_connect(Connection& c) {
+        c.conn = PQconnectStart(DB_CONNINFO);
+        if (!c.conn || PQstatus(c.conn) == CONNECTION_BAD) {
+            cerr << "[Pipeline] connection failed: "
+                 << (c.conn ? PQerrorMessage(c.conn) : "(null)") << "\n";
+            reset(c);
+            return;
+        }
+        c.connecting = true;
+        connecting_now++;
+        c.connect_deadline = chrono::steady_clock::now() + CONNECT_TIMEOUT;
+        watch(c, EPOLLOUT);     // PQconnectPoll starts out waiting to write
+    }
+
+    void advance(Connection& c) {
+        PostgresPollingStatusType st = PQconnectPoll(c.conn);
+        if (st == PGRES_POLLING_READING) watch(c, EPOLLIN);
+        else if (st == PGRES_POLLING_WRITING) watch(c, EPOLLOUT);
+        else if (st != PGRES_POLLING_OK || !setup(c)) {
+            cerr << "[Pipeline] connection failed: " << PQerrorMessage(c.conn) << "\n";
+            drop(c);
+        }
+    }
+
+    // connected: enters pipeline mode and queues the session setup (the
+    // instance tag and the prepared statements) ahead of any request, each
+    // with its own sync so one failing doesn't abort the rest
+    bool setup(Connection& c) {
+        if (PQsetnonblocking(c.conn, 1) != 0 || !PQenterPipelineMode(c.conn)) return false;
+        c.setup = 0;
+        if (!db_instance_tag.empty()) {
+            const char* params[1] = { db_instance_tag.c_str() };
+            if (!PQsendQueryParams(c.conn, DB_TAG_SQL, 1, nullptr, params, nullptr, nullptr, 0) ||
+                !PQpipelineSync(c.conn))
+                return false;
+            c.setup++;
+        }
+        for (const DbStatement& stmt : DB_STATEMENTS) {
+            if (!PQsendPrepare(c.conn, stmt.name, stmt.sql, stmt.params, stmt.types) ||
+                !PQpipelineSync(c.conn))
+                return false;
+            c.setup++;
+        }
+        c.want_write = false;
+        watch(c, EPOLLIN);
+        if (!flush(c)) return false;
+        c.connecting = false;
+        connecting_now--;
+        connections_up++;
+        c.backoff = chrono::milliseconds(100);
+        return true;
+    }
+
+    // flushes pending output, watching for writability while some remains
+    bool flush(Connection& c) {
+        int pending = PQflush(c.conn);
+        if (pending < 0) return false;
+        if ((pending == 1) != c.want_write) {
+            c.want_write = pending == 1;
+            watch(c, EPOLLIN | (c.want_write ? (uint32_t)EPOLLOUT : 0u));
+        }
+        return true;
+    }
+
+    bool send(Connection& c, unique_ptr<Request> r) {
+        static const int formats[3] = { PG_BINARY, PG_BINARY, PG_BINARY };
+        const DbStatement& stmt = DB_STATEMENTS[r->stmt];
+        const char* values[3];
+        int lengths[3];
+        for (size_t i = 0; i < r->params.size(); i++) {
+            values[i] = r->params[i].data();
+            lengths[i] = r->params[i].size();
+        }
+        c.inflight.push_back(move(r));
+        inflight_now++;
+        return PQsendQueryPrepared(c.conn, stmt.name, stmt.params, values, lengths,
+                                   formats, PG_BINARY) &&
+               PQpipelineSync(c.conn);
+    }
+
+    // hands out every result that has fully arrived: a statement's
+    // results, a NULL, then the PGRES_PIPELINE_SYNC that completes it
+    void receive(Connection& c) {
+        while ((c.setup > 0 || !c.inflight.empty()) && !PQisBusy(c.conn)) {
+            PGresult* res = PQgetResult(c.conn);
+            if (!res) continue;
+            if (c.setup > 0) {          // session setup, sent before any request
+                ExecStatusType st = PQresultStatus(res);
+                if (st == PGRES_PIPELINE_SYNC) c.setup--;
+                else if (st != PGRES_COMMAND_OK && st != PGRES_TUPLES_OK)
+                    cerr << "[Pipeline] session setup failed: " << PQresultErrorMessage(res);
+                PQclear(res);
+                continue;
+            }
+            Request* r = c.inflight.front().get();
+            if (PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+                PQclear(res);
+                unique_ptr<Request> done = move(c.inflight.front());
+                c.inflight.pop_front();
+                inflight_now--;
+                PGresult* result = done->result;
+                finish(move(done), result);
+            } else if (!r->result) {
+                r->result = res;
+            } else {
+                PQclear(res);
+            }
+        }
+    }
+
+    // fails queued statements that waited past their deadline, e.g. while
+    // every connection was down or reconnecting; all share one timeout, so
+    // the oldest are at the front
+    void expire() {
+        auto now = chrono::steady_clock::now();
+        vector<unique_ptr<Request>> expired;
+        {
+            lock_guard<mutex> lock(mtx);
+            while (!queue.empty() && queue.front()->deadline <= now) {
+                expired.push_back(move(queue.front()));
+                queue.pop_front();
+            }
+            queued_now = queue.size();
+        }
+        for (auto& r : expired) {
+            timeouts.fetch_add(1, memory_order_relaxed);
+            finish(move(r), nullptr);
+        }
+    }
+
+    // moves queued statements onto the least busy connections; with none
+    // available they stay queued until one is up or they expire
+    void dispatch() {
+        vector<Connection*> touched;
+        while (true) {
+            Connection* best = nullptr;
+            for (auto& c : conns)
+                if (c.conn && !c.connecting && c.inflight.size() < depth &&
+                    (!best || c.inflight.size() < best->inflight.size()))
+                    best = &c;
+
+            unique_ptr<Request> r;
+            {
+                lock_guard<mutex> lock(mtx);
+                if (queue.empty() || !best) break;
+                r = move(queue.front());
+                queue.pop_front();
+                queued_now = queue.size();
+            }
+            if (!send(*best, move(r))) {
+                cerr << "[Pipeline] send failed, reconnecting: " << PQerrorMessage(best->conn) << "\n";
+                drop(*best);
+                reconnects.fetch_add(1, memory_order_relaxed);
+                continue;
+            }
+            if (find(touched.begin(), touched.end(), best) == touched.end()) touched.push_back(best);
+        }
+        for (Connection* c : touched) {
+            if (!c->conn || c->connecting) continue;
+            if (!flush(*c)) {
+                drop(*c);
+                reconnects.fetch_add(1, memory_order_relaxed);
+                continue;
+            }
+            receive(*c);    // flushing may have read results into libpq's buffer
+        }
+        size_t n = inflight_now.load(), m = max_inflight.load(memory_order_relaxed);
+        while (n > m && !max_inflight.compare_exchange_weak(m, n)) {}
+    }
+
+    void run() {
+        epoll_event events[64];
+        while (true) {
+            bool down = false;
+            auto now = chrono::steady_clock::now();
+            for (auto& c : conns) {
+                if (!c.conn && now >= c.retry_at) {
+                    begin_connect(c);
+                } else if (c.connecting && now >= c.connect_deadline) {
+                    cerr << "[Pipeline] connection timed out\n";
+                    drop(c);
+                }
+                down = down || !c.conn || c.connecting;
+            }
+
+            // wake often enough to expire queued statements on time
+            int n = epoll_wait(epoll_fd, events, 64, queued_now > 0 ? 10 : down ? 100 : 1000);
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.u32 == UINT32_MAX) {
+                    uint64_t count;
+                    if (read(wake_fd, &count, sizeof(count)) < 0) {}
+                    continue;
+                }
+                Connection& c = conns[events[i].data.u32];
+                if (!c.conn) continue;
+                if (c.connecting) {
+                    advance(c);
+                    continue;
+                }
+                if ((events[i].events & EPOLLOUT) && !flush(c)) {
+                    drop(c);
+                    reconnects.fetch_add(1, memory_order_relaxed);
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                    if (!PQconsumeInput(c.conn)) {
+                        cerr << "[Pipeline] connection lost, reconnecting: " << PQerrorMessage(c.conn) << "\n";
+                        drop(c);
+                        reconnects.fetch_add(1, memory_order_relaxed);
+                        continue;
+                    }
+                    receive(c);
+                }
+            }
+            dispatch();
+            expire();
+        }
+    }
+
+public:
+    // a statement that can't be sent within queue_timeout (all connections
+    // down, reconnecting or full) fails with nullptr
+    DbPipeline(size_t connections, size_t depth, chrono::milliseconds queue_timeout)
+        : conns(max<size_t>(1, connections)), depth(max<size_t>(1, depth)),
+          queue_timeout(queue_timeout) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u32 = UINT32_MAX;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+    }
+
+    // starts every connection and waits, up to the connect timeout, for
+    // the handshakes, so the first requests don't pay for connection setup
+    void start() {
+        for (auto& c : conns) begin_connect(c);
+        thread([this] { run(); }).detach();
+        auto deadline = chrono::steady_clock::now() + CONNECT_TIMEOUT + chrono::seconds(1);
+        while (connecting_now > 0 && chrono::steady_clock::now() < deadline)
+            this_thread::sleep_for(chrono::milliseconds(10));
+    }
+
+    // queues a prepared statement with binary parameters; done runs on the
+    // loop thread
+    void submit(DbStatementId stmt, vector<string> params, Callback done) {
+        submitted.fetch_add(1, memory_order_relaxed);
+        unique_ptr<Request> r(new Request);
+        r->stmt = stmt;
+        r->params = move(params);
+        r->done = move(done);
+        r->deadline = chrono::steady_clock::now() + queue_timeout;
+        {
+            lock_guard<mutex> lock(mtx);
+            queue.push_back(move(r));
+            queued_now = queue.size();
+        }
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {}
+    }
+
+    // blocking form: the result, or nullptr if the connection failed
+    PGresult* exec(DbStatementId stmt, const char* const* params, const int* lengths) {
+        vector<string> copies;
+        for (int i = 0; i < DB_STATEMENTS[stmt].params; i++) copies.emplace_back(params[i], lengths[i]);
+        mutex m;
+        condition_variable cv;
+        bool done = false;
+        PGresult* result = nullptr;
+        submit(stmt, move(copies), [&](PGresult* res) {
+            lock_guard<mutex> lock(m);
+            result = res;
+            done = true;
+            cv.notify_one();    // under the lock: the waiter's frame goes away after
+        });
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&] { return done; });
+        return result;
+    }
+
+    json stats() const {
+        return {{"connections", conns.size()}, {"connections_up", connections_up.load()},
+                {"connecting", connecting_now.load()},
+                {"depth", depth}, {"in_flight", inflight_now.load()},
+                {"queued", queued_now.load()},
+                {"max_in_flight", max_inflight.load(memory_order_relaxed)},
+                {"submitted", submitted.load(memory_order_relaxed)},
+                {"failed", failed.load(memory_order_relaxed)},
+                {"reconnects", reconnects.load(memory_order_relaxed)},
+                {"timeouts", timeouts.load(memory_order_relaxed)}};
+    }
+};
+
+static unique_ptr<DbPipeline> db_pipeline;     // null unless --db-pipeline or --db-async is set
+static bool db_async = false;                   // handlers complete through db_pipeline callbacks
+
+// Runs one of the hot-path statements, through the pipeline when enabled
+PGresult* db_run(DbStatementId stmt, const char* const* params, const int* lengths) {
+    if (db_pipeline) return db_pipeline->exec(stmt, params, lengths);
+    auto conn = get_connection();
+    if (!conn) return nullptr;
+    PGresult* res = db_exec_prepared(conn, stmt, params, lengths);
+    if (!res) cerr << "[DB] null result: " << PQerrorMessage(conn) << "\n";
+    return res;
+}
+
+// JSON setup
+static std::string to_string_json_value(const nlohmann::json &v) {
+    if (v.is_string()) return v.get<std::string>();
+    if (v.is_number_integer()) return std::to_string(v.get<long long>());
+    if (v.is_number_unsigned()) return std::to_string(v.get<unsigned long long>());
+    if (v.is_number_float()) {
+        std::ostringstream ss;
+        ss << v.get<double>();
+        return ss.str();
+    }
+    return v.dump();
+}
+
+// JSON to integer
+bool jstonToInt(const nlohmann::json &v, int &out) {
+    try {
+        if (v.is_number_integer()) {
+            out = v.get<int>();
+            return true;
+        }
+        if (v.is_string()) {
+            std::string s = v.get<std::string>();
+            if (s.empty()) return false;
+            size_t pos = 0;
+            long long val = std::stoll(s, &pos);
+            if (pos != s.size()) return false;
+            out = (int)val;
+            return true;
+        }
+        if (v.is_number_float()) {
+            out = static_cast<int>(v.get<double>());
+            return true;
+        }
+    } catch (...) { }
+    return false;
+}
+
+// convert route path from string to integer
+bool strToInt(const std::string &s, int &out) {
+    try {
+        if (s.empty()) return false;
+        size_t pos = 0;
+        long long val = std::stoll(s, &pos);
+        if (pos != s.size()) return false;
+        out = (int)val;
+        return true;
+    } catch (...) { return false; }
+}
+
+// Database operations
+enum DbResult { DB_OK, DB_NOT_FOUND, DB_ERROR };
+
+// Result handling shared by the blocking and asynchronous forms; each
+// takes ownership of res (which may be null)
+static bool db_create_result(PGresult* res) {
+    if (!res) return false;
+    bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK);
+    if (!ok) cerr << "[DB] Insert/Update failed: " << PQresultErrorMessage(res) << "\n";
+    PQclear(res);
+    return ok;
+}
+
+static DbResult db_read_result(PGresult* res, std::string& value, int64_t* ttl_ms) {
+    if (!res) return DB_ERROR;
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        cerr << "[DB] Read failed: " << PQresultErrorMessage(res) << "\n";
+        PQclear(res);
+        return DB_ERROR;
+    }
+    if (PQntuples(res) == 0) {
+        PQclear(res);
+        return DB_NOT_FOUND;
+    }
+
+    value.assign(PQgetvalue(res, 0, 0), PQgetlength(res, 0, 0));
+    if (ttl_ms) *ttl_ms = PQgetisnull(res, 0, 1) ? 0 : max<int64_t>(1, pg_get_int8(res, 0, 1));
+    PQclear(res);
+    return DB_OK;
+}
+
+static bool db_delete_result(PGresult* res) {
+    if (!res) return false;
+    bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK && atoi(PQcmdTuples(res)) > 0);
+    PQclear(res);
+    return ok;
+}
+
+// ttl_seconds > 0 makes the row expire; 0 clears any previous expiry
+bool db_create(int key, const std::string& value, int ttl_seconds = 0) {
+    std::string keybin = pg_int8(key);
+    std::string ttlbin = pg_int4(ttl_seconds);
+    const char *paramValues[3] = { keybin.data(), value.data(), ttlbin.data() };
+    const int paramLengths[3] = { (int)keybin.size(), (int)value.size(), (int)ttlbin.size() };
+
+    return db_create_result(db_run(ttl_seconds > 0 ? STMT_CREATE_TTL : STMT_CREATE,
+                                   paramValues, paramLengths));
+}
+
+// Expired rows are treated as missing. ttl_ms, if given, receives the
+// row's remaining lifetime in milliseconds (0 when it never expires).
+DbResult db_read(int key, std::string& value, int64_t* ttl_ms = nullptr) {
+    std::string keybin = pg_int8(key);
+    const char *paramValues[1] = { keybin.data() };
+    const int paramLengths[1] = { (int)keybin.size() };
+
+    return db_read_result(db_run(STMT_READ, paramValues, paramLengths), value, ttl_ms);
+}
+
+bool db_delete(int key) {
+    std::string keybin = pg_int8(key);
+    const char *paramValues[1] = { keybin.data() };
+    const int paramLengths[1] = { (int)keybin.size() };
+
+    return db_delete_result(db_run(STMT_DELETE, paramValues, paramLengths));
+}
+
+// Asynchronous forms, for --db-async: they return at once and call done
+// on the pipeline's loop thread (or the caller's, if no connection is up)
+void db_create_async(int key, const std::string& value, int ttl_seconds,
+                     std::function<void(bool)> done) {
+    db_pipeline->submit(ttl_seconds > 0 ? STMT_CREATE_TTL : STMT_CREATE,
+                        { pg_int8(key), value, pg_int4(ttl_seconds) },
+                        [done](PGresult* res) { done(db_create_result(res)); });
+}
+
+void db_read_async(int key, std::function<void(DbResult, const std::string&, int64_t)> done) {
+    db_pipeline->submit(STMT_READ, { pg_int8(key) }, [done](PGresult* res) {
+        std::string value;
+        int64_t ttl_ms = 0;
+        DbResult r = db_read_result(res, value, &ttl_ms);
+        done(r, value, ttl_ms);
+    });
+}
+
+void db_delete_async(int key, std::function<void(bool)> done) {
+    db_pipeline->submit(STMT_DELETE, { pg_int8(key) },
+                        [done](PGresult* res) { done(db_delete_result(res)); });
+}
+
+// Reads many keys at once; expired rows are skipped like in db_read.
+// Each row found is appended as (key, value, remaining ttl ms or 0).
+bool db_read_batch(const std::vector<int>& keys,
+                   std::vector<std::tuple<int, std::string, int64_t>>& rows) {
+    auto conn = get_connection();
+    if (!conn) return false;
+
+    std::vector<std::string> keybins;
+    for (int k : keys) keybins.push_back(pg_int8(k));
+    std::string arr = pg_binary_array(PG_INT8, keybins);
+    const Oid paramTypes[1] = { PG_INT8_ARRAY };
+    const char *paramValues[1] = { arr.data() };
+    const int paramLengths[1] = { (int)arr.size() };
+    const int paramFormats[1] = { PG_BINARY };
+
+    PGresult* res = PQexecParams(conn,
+        "SELECT \"key\", value, (extract(epoch from expires_at - now()) * 1000)::bigint "
+        "FROM kv_store WHERE \"key\" = ANY($1) "
+        "AND (expires_at IS NULL OR expires_at > now())",
+        1, paramTypes, paramValues, paramLengths, paramFormats, PG_BINARY);
+    if (!res) {
+        cerr << "[DB] null result from batch read: " << PQerrorMessage(conn) << "\n";
+        return false;
+    }
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        cerr << "[DB] Batch read failed: " << PQerrorMessage(conn) << "\n";
+        PQclear(res);
+        return false;
+    }
+    for (int i = 0; i < PQntuples(res); i++) {
+        int64_t ttl = PQgetisnull(res, i, 2) ? 0 : max<int64_t>(1, pg_get_int8(res, i, 2));
+        rows.emplace_back((int)pg_get_int8(res, i, 0),
+                          std::string(PQgetvalue(res, i, 1), PQgetlength(res, i, 1)), ttl);
+    }
+    PQclear(res);
+    return true;
+}
+
+// Applies a batch of write-back changes in one transaction. puts hold
+// (key, value, absolute expiry in epoch ms or 0), deletes hold keys.
+bool db_apply_batch(const std::vector<std::tuple<int, std::string, int64_t>>& puts,
+                    const std::vector<int>& deletes) {
+    auto conn = get_connection();
+    if (!conn) return false;
+
+    // parameters are binary arrays; types come from the casts in the SQL
+    auto exec = [&conn](const char* sql, const std::vector<std::string>& params) {
+        static const int formats[3] = { PG_BINARY, PG_BINARY, PG_BINARY };
+        const char* values[3];
+        int lengths[3];
+        for (size_t i = 0; i < params.size(); i++) {
+            values[i] = params[i].data();
+            lengths[i] = params[i].size();
+        }
+        PGresult* res = params.empty()
+            ? PQexec(conn, sql)
+            : PQexecParams(conn, sql, params.size(), NULL, values, lengths, formats, PG_BINARY);
+        bool ok = res && PQresultStatus(res) == PGRES_COMMAND_OK;
+        if (!ok) cerr << "[DB] Batch apply failed: " << PQerrorMessage(conn) << "\n";
+        if (res) PQclear(res);
+        return ok;
+    };
+
+    if (!exec("BEGIN", {})) return false;
+    bool ok = true;
+    if (!puts.empty()) {
+        std::vector<std::string> keys, values, expiries;
+        for (auto& p : puts) {
+            keys.push_back(pg_int8(get<0>(p)));
+            values.push_back(get<1>(p));
+            expiries.push_back(pg_int8(get<2>(p)));
+        }
+        ok = exec(
+            "INSERT INTO kv_store(\"key\", value, expires_at) "
+            "SELECT k, v, CASE WHEN e > 0 THEN to_timestamp(e / 1000.0) END "
+            "FROM unnest($1::bigint[], $2::bytea[], $3::bigint[]) AS u(k, v, e) "
+            "ON CONFLICT (\"key\") DO UPDATE SET value = EXCLUDED.value, "
+            "expires_at = EXCLUDED.expires_at",
+            { pg_binary_array(PG_INT8, keys), pg_binary_array(PG_BYTEA, values),
+              pg_binary_array(PG_INT8, expiries) });
+    }
+    if (ok && !deletes.empty()) {
+        std::vector<std::string> keys;
+        for (int k : deletes) keys.push_back(pg_int8(k));
+        ok = exec("DELETE FROM kv_store WHERE \"key\" = ANY($1::bigint[])",
+                  { pg_binary_array(PG_INT8, keys) });
+    }
+    if (!ok) {
+        exec("ROLLBACK", {});
+        return false;
+    }
+    return exec("COMMIT", {});
+}
+
+// Adds the expiry column and its partial index if the table predates TTLs
+bool db_ensure_schema() {
+    auto conn = get_connection();
+    if (!conn) return false;
+
+    PGresult* res = PQexec(conn,
+        "ALTER TABLE kv_store ADD COLUMN IF NOT EXISTS expires_at timestamptz; "
+        "CREATE INDEX IF NOT EXISTS kv_store_expires_at_idx ON kv_store (expires_at) "
+        "WHERE expires_at IS NOT NULL");
+    bool ok = res && PQresultStatus(res) == PGRES_COMMAND_OK;
+    if (!ok) cerr << "[DB] Schema update failed: " << PQerrorMessage(conn) << "\n";
+    if (res) PQclear(res);
+
+    // statements prepared against the old columns can't change result type
+    if (ok) {
+        res = PQexec(conn, "DEALLOCATE ALL");
+        if (res) PQclear(res);
+        db_prepare_all(conn);
+    }
+    return ok;
+}
+
+// Type of kv_store.value (e.g. "bytea"), or "" if it couldn't be read.
+// Values are sent as bytea; against a text column Postgres would store
+// their hex text form instead, so the server must not run on one.
+string db_value_type() {
+    auto conn = get_connection();
+    if (!conn) return "";
+    PGresult* res = PQexec(conn,
+        "SELECT format_type(atttypid, atttypmod) FROM pg_attribute "
+        "WHERE attrelid = 'kv_store'::regclass AND attname = 'value'");
+    string type;
+    if (res && PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+        type = PQgetvalue(res, 0, 0);
+    else
+        cerr << "[DB] Could not read the kv_store.value type: " << PQerrorMessage(conn) << "\n";
+    if (res) PQclear(res);
+    return type;
+}
+
+// Converts a text value column to bytea (the text's UTF-8 bytes). Only run
+// with --migrate-bytea=1: it rewrites the whole table under an exclusive
+// lock, and servers built before the binary format can't share it after.
+bool db_migrate_value_to_bytea() {
+    auto conn = get_connection();
+    if (!conn) return false;
+    auto start = chrono::steady_clock::now();
+    PGresult* res = PQexec(conn,
+        "ALTER TABLE kv_store ALTER COLUMN value TYPE bytea "
+        "USING convert_to(value::text, 'UTF8')");
+    bool ok = res && PQresultStatus(res) == PGRES_COMMAND_OK;
+    if (res) PQclear(res);
+    if (!ok) {
+        cerr << "[DB] value column migration failed: " << PQerrorMessage(conn) << "\n";
+        return false;
+    }
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+    cout << "[DB] kv_store.value converted to bytea in " << ms.count() << " ms\n";
+    res = PQexec(conn, "DEALLOCATE ALL");
+    if (res) PQclear(res);
+    db_prepare_all(conn);
+    return true;
+}
+
+// Row trigger that NOTIFYs kv_invalidate with "<instance>:<key>" for every
+// write to kv_store, so other servers can drop their cached copies.
+// Created once; concurrent starts may race, which only fails one of them.
+bool db_install_invalidation_trigger() {
+    auto conn = get_connection();
+    if (!conn) return false;
+
+    PGresult* res = PQexec(conn,
+        "CREATE OR REPLACE FUNCTION kv_store_notify() RETURNS trigger AS $$ "
+        "BEGIN "
+        "  PERFORM pg_notify('kv_invalidate', "
+        "      coalesce(current_setting('kvserver.instance', true), '') || ':' || "
+        "      (CASE WHEN TG_OP = 'DELETE' THEN OLD.key ELSE NEW.key END)::text); "
+        "  RETURN NULL; "
+        "END $$ LANGUAGE plpgsql; "
+        "DO $$ BEGIN "
+        "  IF NOT EXISTS (SELECT 1 FROM pg_trigger WHERE tgname = 'kv_store_notify' "
+        "                 AND tgrelid = 'kv_store'::regclass) THEN "
+        "    CREATE TRIGGER kv_store_notify AFTER INSERT OR UPDATE OR DELETE ON kv_store "
+        "      FOR EACH ROW EXECUTE PROCEDURE kv_store_notify(); "
+        "  END IF; "
+        "END $$");
+    bool ok = res && PQresultStatus(res) == PGRES_COMMAND_OK;
+    if (!ok) cerr << "[DB] Invalidation trigger setup failed: " << PQerrorMessage(conn) << "\n";
+    if (res) PQclear(res);
+    return ok;
+}
+
+// Deletes up to `batch` expired rows; returns how many were removed, -1 on error
+long db_reap_expired(int batch) {
+    auto conn = get_connection();
+    if (!conn) return -1;
+
+    std::string batchstr = std::to_string(batch);
+    const char *paramValues[1] = { batchstr.c_str() };
+
+    PGresult* res = PQexecParams(conn,
+        "DELETE FROM kv_store WHERE ctid = ANY(ARRAY("
+        "SELECT ctid FROM kv_store WHERE expires_at <= now() LIMIT $1::int))",
+        1, NULL, paramValues, NULL, NULL, 0);
+    if (!res) {
+        cerr << "[DB] null result from reap: " << PQerrorMessage(conn) << "\n";
+        return -1;
+    }
+    long n = -1;
+    if (PQresultStatus(res) == PGRES_COMMAND_OK) n = atol(PQcmdTuples(res));
+    else cerr << "[DB] Reap failed: " << PQerrorMessage(conn) << "\n";
+    PQclear(res);
+    return n;
+}
+
+// Request coalescing (single-flight): concurrent cache misses for the same
+// key share one DB fetch. The first caller runs it, later callers wait for
+// its result instead of issuing the same query. Writers call forget() once
+// their change is committed, so readers arriving afterwards start a fresh
+// fetch rather than joining one that may return the old value. run() blocks
+// its caller; run_async() takes a callback instead, and both kinds of caller
+// can share one fetch. A fetch that throws completes the call with DB_ERROR
+// before the exception propagates.
+class SingleFlight {
+public:
+    typedef function<void(DbResult, const string&)> Callback;
+
+private:
+    struct Call {
+        mutex mtx;
+        condition_variable cv;
+        bool done = false;
+        DbResult result = DB_ERROR;
+        string value;
+        vector<Callback> waiters;   // run_async callers
+    };
+
+    struct Shard {
+        mutex mtx;
+        unordered_map<string, shared_ptr<Call>> calls;
+    };
+
+    vector<unique_ptr<Shard>> shards;
+    atomic<uint64_t> coalesced{0};
+
+    Shard& shard_for(const string& key) const {
+        return *shards[hash<string>{}(key) % shards.size()];
+    }
+
+public:
+    SingleFlight(size_t nshards) {
+        if (nshards == 0) nshards = 1;
+        for (size_t i = 0; i < nshards; i++) shards.emplace_back(new Shard);
+    }
+
+    template <class Fetch>
+    DbResult run(const string& key, string& value, Fetch fetch) {
+        Shard& s = shard_for(key);
+        shared_ptr<Call> call;
+        bool leader = false;
+        {
+            lock_guard<mutex> lock(s.mtx);
+            auto& slot = s.calls[key];
+            if (!slot) {
+                slot = make_shared<Call>();
+                leader = true;
+            }
+            call = slot;
+        }
+
+        if (!leader) {
+            coalesced.fetch_add(1, memory_order_relaxed);
+            unique_lock<mutex> lock(call->mtx);
+            call->cv.wait(lock, [&]{ return call->done; });
+            if (call->result == DB_OK) value = call->value;
+            return call->result;
+        }
+
+        // a throwing fetch must still release the waiters and the slot
+        DbResult r;
+        try {
+            r = fetch(value);
+        } catch (...) {
+            complete(s, key, call, DB_ERROR, string());
+            throw;
+        }
+        complete(s, key, call, r, value);
+        return r;
+    }
+
+    void forget(const string& key) {
+        Shard& s = shard_for(key);
+        lock_guard<mutex> lock(s.mtx);
+        s.calls.erase(key);
+    }
+
+    size_t inflight() const {
+        size_t n = 0;
+        for (auto& s : shards) {
+            lock_guard<mutex> lock(s->mtx);
+            n += s->calls.size();
+        }
+        return n;
+    }
+
+    uint64_t coalesced_count() const { return coalesced.load(memory_order_relaxed); }
+
+private:
+    void complete(Shard& s, const string& key, const shared_ptr<Call>& call,
+                  DbResult r, const string& value) {
+        {
+            lock_guard<mutex> lock(s.mtx);
+            auto it = s.calls.find(key);
+            if (it != s.calls.end() && it->second == call) s.calls.erase(it);
+        }
+        vector<Callback> waiters;
+        {
+            lock_guard<mutex> lock(call->mtx);
+            if (call->done) return;     // a fetch that finished, then threw
+            call->result = r;
+            if (r == DB_OK) call->value = value;
+            call->done = true;
+            waiters.swap(call->waiters);
+        }
+        call->cv.notify_all();
+        for (auto& w : waiters) w(r, value);
+    }
+
+public:
+    // fetch(finish) starts the fetch and calls finish(result, value) once,
+    // from any thread; done runs once this key's fetch has completed
+    template <class FetchAsync>
+    void run_async(const string& key, FetchAsync fetch, Callback done) {
+        Shard& s = shard_for(key);
+        shared_ptr<Call> call;
+        bool leader = false;
+        {
+            lock_guard<mutex> lock(s.mtx);
+            auto& slot = s.calls[key];
+            if (!slot) {
+                slot = make_shared<Call>();
+                leader = true;
+            }
+            call = slot;
+        }
+
+        {
+            unique_lock<mutex> lock(call->mtx);
+            if (!call->done) {
+                call->waiters.push_back(move(done));
+                done = nullptr;
+            }
+        }
+        if (done) {             // finished between the two locks
+            done(call->result, call->value);
+            return;
+        }
+        if (!leader) {
+            coalesced.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        try {
+            fetch([this, &s, key, call](DbResult r, const string& value) {
+                complete(s, key, call, r, value);
+            });
+        } catch (...) {
+            complete(s, key, call, DB_ERROR, string());
+            throw;
+        }
+    }
+};
+
+// Hierarchical timer wheel for cache entry expiry: 4 levels of 256 slots,
+// level 0 advancing one slot per tick and each higher level covering 256x
+// the span of the one below. Scheduling and firing are O(1); timers in
+// higher levels are cascaded down as their slot comes due. Rescheduling or
+// cancelling only drops the key from the live map, and stale timers are
+// skipped when they fire. Keys without a TTL never enter the wheel, and
+// cancel() is a single atomic load while the wheel is empty.
+class TimerWheel {
+    static const int LEVELS = 4;
+    static const int BITS = 8;
+    static const uint64_t SLOTS = 1 << BITS;
+
+    struct Timer {
+        string key;
+        uint64_t deadline;      // in ticks
+        uint64_t id;
+    };
+
+    chrono::steady_clock::time_point start;
+    chrono::milliseconds tick;
+    uint64_t current = 0;
+    uint64_t next_id = 1;
+    size_t stored = 0;          // timers in slots, including stale ones
+    vector<Timer> slots[LEVELS][SLOTS];
+    unordered_map<string, uint64_t> live;     // key -> id of its pending timer
+    atomic<size_t> live_count{0};
     mutable mutex mtx;
 
+    void place(Timer&& t) {
+        if (t.deadline <= current) t.deadline = current + 1;
+        uint64_t delta = t.deadline - current;
+        for (int level = 0; level < LEVELS; level++) {
+            if (delta < (SLOTS << (level * BITS)) || level == LEVELS - 1) {
+                uint64_t d = t.deadline;
+                // beyond the top level's span: park it in the furthest slot
+                if (level == LEVELS - 1 && delta >= (SLOTS << (level * BITS)))
+                    d = current + (SLOTS << (level * BITS)) - 1;
+                slots[level][(d >> (level * BITS)) & (SLOTS - 1)].push_back(move(t));
+                return;
+            }
+        }
+    }
+
+    void cascade(int level) {
+        vector<Timer> pending;
+        pending.swap(slots[level][(current >> (level * BITS)) & (SLOTS - 1)]);
+        for (auto& t : pending) {
+            // due on this very tick, whose level-0 slot fires right after
+            if (t.deadline <= current) slots[0][current & (SLOTS - 1)].push_back(move(t));
+            else place(move(t));
+        }
+    }
+
+    uint64_t now_tick() const {
+        return (chrono::steady_clock::now() - start) / tick;
+    }
+
+public:
+    TimerWheel(chrono::milliseconds tick_ms)
+        : start(chrono::steady_clock::now()), tick(tick_ms) {}
+
+    chrono::milliseconds tick_length() const { return tick; }
+
+    void schedule(const string& key, int64_t ttl_ms) {
+        lock_guard<mutex> lock(mtx);
+        uint64_t ticks = (ttl_ms + tick.count() - 1) / tick.count();
+        uint64_t id = next_id++;
+        live[key] = id;
+        live_count.store(live.size(), memory_order_relaxed);
+        place(Timer{key, now_tick() + ticks, id});
+        stored++;
+    }
+
+    void cancel(const string& key) {
+        if (live_count.load(memory_order_relaxed) == 0) return;
+        lock_guard<mutex> lock(mtx);
+        live.erase(key);
+        live_count.store(live.size(), memory_order_relaxed);
+    }
+
+    // Advances to the current time and returns the keys that expired
+    vector<string> advance() { return advance_to(now_tick()); }
+
+    // Advances to the given tick (counted from construction); lets tests
+    // step the wheel without waiting
+    vector<string> advance_to(uint64_t target) {
+        vector<string> expired;
+        lock_guard<mutex> lock(mtx);
+        if (stored == 0) {
+            current = max(current, target);
+            return expired;
+        }
+        while (current < target) {
+            current++;
+            for (int level = 1; level < LEVELS; level++) {
+                if ((current & ((1ull << (level * BITS)) - 1)) != 0) break;
+                cascade(level);
+            }
+            auto& due = slots[0][current & (SLOTS - 1)];
+            for (auto& t : due) {
+                stored--;
+                if (t.deadline > current) {      // parked beyond the top level
+                    stored++;
+                    place(move(t));
+                    continue;
+                }
+                auto it = live.find(t.key);
+                if (it == live.end() || it->second != t.id) continue;
+                live.erase(it);
+                expired.push_back(move(t.key));
+            }
+            due.clear();
+        }
+        live_count.store(live.size(), memory_order_relaxed);
+        return expired;
+    }
+
+    size_t size() const { return live_count.load(memory_order_relaxed); }
+};
+
+// Cache warm-up: the hottest cached keys are periodically saved to a small
+// binary file (magic, count, then little-endian int32 keys), written to a
+// temporary name and renamed so a crash never leaves a torn list. On
+// startup the saved keys are read back from kv_store in large batches and
+// loaded into the cache, with progress exposed for readiness checks.
+class CacheWarmer {
+    static constexpr char MAGIC[8] = {'K', 'V', 'H', 'O', 'T', '0', '0', '1'};
+    static const uint32_t MAX_KEYS = 1 << 24;  // per snapshot, so a bad count can't balloon
+
+    string path;
+    atomic<size_t> total{0}, fetched{0}, loaded{0};
+    atomic<bool> finished{false};
+
 public:
-    LRUCache(int cap) { capacity = cap; }
+    CacheWarmer(const string& file) : path(file) {
+        if (path.empty()) finished = true;
+    }
 
-    void put(const string& key, const string& value) {
-        lock_guard<mutex> lock(mtx);
-        auto it = kvmap.find(key);
-        if (it != kvmap.end()) kvcache.erase(it->second);
+    bool enabled() const { return !path.empty(); }
+    bool done() const { return finished.load(); }
+
+    bool save(const vector<string>& keys) const {
+        vector<int32_t> ids;
+        ids.reserve(keys.size());
+        for (auto& k : keys) {
+            int v;
+            if (ids.size() < MAX_KEYS && strToInt(k, v)) ids.push_back(v);
+        }
+
+        string tmp = path + ".tmp";
+        ofstream out(tmp, ios::binary | ios::trunc);
+        if (!out) return false;
+        uint32_t n = ids.size();
+        out.write(MAGIC, sizeof(MAGIC));
+        out.write((const char*)&n, sizeof(n));
+        out.write((const char*)ids.data(), ids.size() * sizeof(int32_t));
+        out.close();
+        if (!out) return false;
+        return rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    // the saved keys; none if the file is missing, truncated or corrupt
+    vector<int> load_keys() const {
+        vector<int> keys;
+        ifstream in(path, ios::binary | ios::ate);
+        if (!in) return keys;
+        uint64_t size = in.tellg();
+        in.seekg(0);
+        char magic[sizeof(MAGIC)];
+        uint32_t n = 0;
+        if (!in.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            !in.read((char*)&n, sizeof(n))) {
+            cerr << "[Warmup] ignoring unrecognized hot key file " << path << "\n";
+            return keys;
+        }
+        // check the count before allocating for it
+        if (n > MAX_KEYS || size != sizeof(MAGIC) + sizeof(n) + (uint64_t)n * sizeof(int32_t)) {
+            cerr << "[Warmup] ignoring hot key file " << path << ": " << n << " keys in "
+                 << size << " bytes\n";
+            return keys;
+        }
+        vector<int32_t> ids(n);
+        if (!in.read((char*)ids.data(), n * sizeof(int32_t))) return keys;
+        keys.assign(ids.begin(), ids.end());
+        return keys;
+    }
 
-        kvcache.push_front({key, value});
-        kvmap[key] = kvcache.begin();
+    // Loads the saved keys batch by batch; fill(key, value, ttl_ms, stamp)
+    // puts one row in the cache, stamp being the key's version before the read
+    template <class Stamp, class Fill>
+    void warm(size_t batch, Stamp stamp, Fill fill) {
+        vector<int> keys = load_keys();
+        total = keys.size();
+        for (size_t i = 0; i < keys.size(); i += batch) {
+            vector<int> part(keys.begin() + i, keys.begin() + min(keys.size(), i + batch));
+            vector<uint64_t> stamps;
+            for (int k : part) stamps.push_back(stamp(to_string(k)));
 
-        if (kvcache.size() > capacity) {
-            auto last = kvcache.back();
-            kvmap.erase(last.first);
-            kvcache.pop_back();
+            vector<tuple<int, string, int64_t>> rows;
+            if (!db_read_batch(part, rows)) {
+                cerr << "[Warmup] batch read failed, stopping after " << loaded << " keys\n";
+                break;
+            }
+            unordered_map<int, uint64_t> before;
+            for (size_t j = 0; j < part.size(); j++) before[part[j]] = stamps[j];
+            for (auto& r : rows) {
+                fill(to_string(get<0>(r)), get<1>(r), get<2>(r), before[get<0>(r)]);
+                loaded++;
+            }
+            fetched += part.size();
         }
+        finished = true;
     }
 
-    bool get(const string& key, string& value) {
+    json progress() const {
+        return {{"enabled", enabled()}, {"done", done()}, {"total", total.load()},
+                {"fetched", fetched.load()}, {"loaded", loaded.load()}};
+    }
+};
+
+constexpr char CacheWarmer::MAGIC[8];
+
+// Write-back mode: /create and /delete are appended to a local journal and
+// acknowledged once it is fsynced, then flushed to Postgres asynchronously.
+//
+// Records are [u32 length][u32 crc32][u8 op][u64 lsn][i32 key][i64 expiry ms]
+// [value] in numbered segment files PATH.000001, PATH.000002, ... A writer
+// thread appends whatever has queued up with one write() and one fdatasync()
+// (group commit), and only then publishes the changes to the dirty map,
+// which keeps the latest journaled change per key until it reaches the DB.
+// The flusher takes batches from the dirty map (so repeated writes to a key
+// coalesce into one), applies them in a single transaction, and deletes
+// full segments once every record in them has been flushed. On startup all
+// segments are replayed, stopping at the first torn or corrupt record.
+class WriteBackJournal {
+public:
+    enum Op : uint8_t { PUT = 1, DEL = 2 };
+    enum Lookup { CLEAN, DIRTY_PUT, DIRTY_DELETE };
+
+private:
+    static const size_t SEGMENT_BYTES = 64 << 20;
+    static const size_t HEADER_BYTES = 8;
+    static const size_t FIXED_BYTES = 1 + 8 + 4 + 8;
+
+    struct Change {
+        Op op;
+        string value;
+        int64_t expires_ms;     // absolute epoch ms, 0 = no expiry
+        uint64_t lsn;
+    };
+
+    struct Segment {
+        uint64_t seq;
+        uint64_t last_lsn;
+    };
+
+    string base;
+    size_t flush_batch;
+    chrono::milliseconds flush_interval;
+
+    int fd = -1;
+    uint64_t seg_seq = 0;
+    size_t seg_bytes = 0;
+    deque<Segment> closed;      // full segments, oldest first
+
+    mutable mutex mtx;
+    condition_variable queued_cv, durable_cv;
+    string queue_buf;           // encoded records not yet written
+    vector<pair<int, Change>> queue_changes;
+    unordered_map<int, Change> dirty;
+    uint64_t next_lsn = 1, queued_lsn = 0, durable_lsn = 0;
+    bool failed = false;
+    atomic<uint64_t> fsyncs{0}, flushed{0};
+
+    string segment_path(uint64_t seq) const {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), ".%06llu", (unsigned long long)seq);
+        return base + suffix;
+    }
+
+    static void encode(string& out, Op op, uint64_t lsn, int key, int64_t expires_ms,
+                       const string& value) {
+        uint32_t len = FIXED_BYTES + value.size();
+        string payload;
+        payload.reserve(len);
+        payload.push_back((char)op);
+        payload.append((const char*)&lsn, 8);
+        payload.append((const char*)&key, 4);
+        payload.append((const char*)&expires_ms, 8);
+        payload.append(value);
+        uint32_t crc = crc32(0L, (const Bytef*)payload.data(), payload.size());
+        out.append((const char*)&len, 4);
+        out.append((const char*)&crc, 4);
+        out.append(payload);
+    }
+
+    // newer lsn wins; replayed and live changes both go through here
+    void publish(int key, Change&& c) {
+        auto it = dirty.find(key);
+        if (it == dirty.end()) dirty.emplace(key, move(c));
+        else if (it->second.lsn < c.lsn) it->second = move(c);
+    }
+
+    bool open_segment(uint64_t seq) {
+        fd = ::open(segment_path(seq).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            cerr << "[Journal] cannot open " << segment_path(seq) << ": " << strerror(errno) << "\n";
+            return false;
+        }
+        seg_seq = seq;
+        seg_bytes = 0;
+        return true;
+    }
+
+    vector<uint64_t> list_segments() const {
+        vector<uint64_t> seqs;
+        size_t slash = base.rfind('/');
+        string dir = slash == string::npos ? "." : base.substr(0, slash);
+        string prefix = (slash == string::npos ? base : base.substr(slash + 1)) + ".";
+        DIR* d = opendir(dir.c_str());
+        if (!d) return seqs;
+        while (dirent* e = readdir(d)) {
+            string name = e->d_name;
+            if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0) continue;
+            string num = name.substr(prefix.size());
+            if (num.find_first_not_of("0123456789") != string::npos) continue;
+            seqs.push_back(stoull(num));
+        }
+        closedir(d);
+        sort(seqs.begin(), seqs.end());
+        return seqs;
+    }
+
+    // returns the last lsn in the segment (0 if empty); truncates a torn tail
+    uint64_t replay_segment(uint64_t seq, size_t& records) {
+        string path = segment_path(seq);
+        ifstream in(path, ios::binary);
+        string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        size_t pos = 0;
+        uint64_t last = 0;
+        while (pos + HEADER_BYTES <= data.size()) {
+            uint32_t len, crc;
+            memcpy(&len, data.data() + pos, 4);
+            memcpy(&crc, data.data() + pos + 4, 4);
+            if (len < FIXED_BYTES || pos + HEADER_BYTES + len > data.size()) break;
+            const char* p = data.data() + pos + HEADER_BYTES;
+            if (crc32(0L, (const Bytef*)p, len) != crc) break;
+
+            Change c;
+            int key;
+            c.op = (Op)p[0];
+            memcpy(&c.lsn, p + 1, 8);
+            memcpy(&key, p + 9, 4);
+            memcpy(&c.expires_ms, p + 13, 8);
+            c.value.assign(p + FIXED_BYTES, len - FIXED_BYTES);
+            last = c.lsn;
+            next_lsn = max(next_lsn, c.lsn + 1);
+            publish(key, move(c));
+            records++;
+            pos += HEADER_BYTES + len;
+        }
+        if (pos < data.size()) {
+            cerr << "[Journal] " << path << ": discarding " << data.size() - pos
+                 << " bytes after the last valid record\n";
+            if (truncate(path.c_str(), pos) != 0)
+                cerr << "[Journal] truncate failed: " << strerror(errno) << "\n";
+        }
+        return last;
+    }
+
+    void writer_loop() {
+        while (true) {
+            string buf;
+            vector<pair<int, Change>> changes;
+            uint64_t target;
+            {
+                unique_lock<mutex> lock(mtx);
+                queued_cv.wait(lock, [&]{ return !queue_buf.empty(); });
+                buf.swap(queue_buf);
+                changes.swap(queue_changes);
+                target = queued_lsn;
+            }
+
+            bool ok = true;
+            size_t off = 0;
+            while (ok && off < buf.size()) {
+                ssize_t n = ::write(fd, buf.data() + off, buf.size() - off);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) ok = false;
+                else off += n;
+            }
+            if (ok && fdatasync(fd) != 0) ok = false;
+            fsyncs++;
+
+            unique_lock<mutex> lock(mtx);
+            if (!ok) {
+                cerr << "[Journal] write failed, rejecting further writes: " << strerror(errno) << "\n";
+                failed = true;
+                durable_cv.notify_all();
+                return;
+            }
+            for (auto& c : changes) publish(c.first, move(c.second));
+            durable_lsn = target;
+            seg_bytes += buf.size();
+            if (seg_bytes >= SEGMENT_BYTES) {
+                ::close(fd);
+                closed.push_back({seg_seq, target});
+                if (!open_segment(seg_seq + 1)) {
+                    failed = true;
+                    durable_cv.notify_all();
+                    return;
+                }
+            }
+            durable_cv.notify_all();
+        }
+    }
+
+    void flusher_loop() {
+        while (true) {
+            this_thread::sleep_for(flush_interval);
+            while (flush_once() == flush_batch) { }
+            trim_segments();
+        }
+    }
+
+    size_t flush_once() {
+        vector<tuple<int, string, int64_t>> puts;
+        vector<int> deletes;
+        vector<pair<int, uint64_t>> taken;
+        {
+            lock_guard<mutex> lock(mtx);
+            for (auto& kv : dirty) {
+                if (taken.size() >= flush_batch) break;
+                if (kv.second.op == PUT) puts.emplace_back(kv.first, kv.second.value, kv.second.expires_ms);
+                else deletes.push_back(kv.first);
+                taken.emplace_back(kv.first, kv.second.lsn);
+            }
+        }
+        if (taken.empty()) return 0;
+        if (!db_apply_batch(puts, deletes)) return 0;
+
         lock_guard<mutex> lock(mtx);
-        auto it = kvmap.find(key);
-        if (it == kvmap.end()) return false;
+        for (auto& t : taken) {
+            auto it = dirty.find(t.first);
+            // a newer change for the key arrived meanwhile; it stays dirty
+            if (it != dirty.end() && it->second.lsn == t.second) dirty.erase(it);
+        }
+        flushed += taken.size();
+        return taken.size();
+    }
+
+    void trim_segments() {
+        vector<uint64_t> drop;
+        {
+            lock_guard<mutex> lock(mtx);
+            if (closed.empty()) return;
+            uint64_t min_dirty = UINT64_MAX;
+            for (auto& kv : dirty) min_dirty = min(min_dirty, kv.second.lsn);
+            while (!closed.empty() && closed.front().last_lsn < min_dirty) {
+                drop.push_back(closed.front().seq);
+                closed.pop_front();
+            }
+        }
+        for (uint64_t seq : drop) unlink(segment_path(seq).c_str());
+    }
+
+public:
+    WriteBackJournal(const string& path, size_t batch, chrono::milliseconds interval)
+        : base(path), flush_batch(max<size_t>(batch, 1)), flush_interval(interval) {}
+
+    // Replays existing segments and starts the writer and flusher threads
+    bool start() {
+        size_t records = 0;
+        uint64_t last_seq = 0;
+        for (uint64_t seq : list_segments()) {
+            uint64_t last = replay_segment(seq, records);
+            closed.push_back({seq, last});
+            last_seq = seq;
+        }
+        durable_lsn = queued_lsn = next_lsn - 1;
+        if (records)
+            cout << "[Journal] replayed " << records << " records, " << dirty.size()
+                 << " keys pending flush\n";
+        if (!open_segment(last_seq + 1)) return false;
 
-        value = it->second->second;
-        kvcache.erase(it->second);
-        kvcache.push_front({key, value});
-        kvmap[key] = kvcache.begin();
+        thread([this]{ writer_loop(); }).detach();
+        thread([this]{ flusher_loop(); }).detach();
         return true;
     }
 
-    void remove(const string& key) {
+    // Journals one change and blocks until it is durable
+    bool append(Op op, int key, const string& value, int64_t expires_ms) {
+        unique_lock<mutex> lock(mtx);
+        if (failed) return false;
+        uint64_t lsn = next_lsn++;
+        encode(queue_buf, op, lsn, key, expires_ms, value);
+        queue_changes.emplace_back(key, Change{op, value, expires_ms, lsn});
+        queued_lsn = lsn;
+        queued_cv.notify_one();
+        durable_cv.wait(lock, [&]{ return durable_lsn >= lsn || failed; });
+        return durable_lsn >= lsn;
+    }
+
+    // Latest journaled change for a key that hasn't reached the DB yet
+    Lookup lookup(int key, string& value, int64_t& expires_ms) const {
         lock_guard<mutex> lock(mtx);
-        auto it = kvmap.find(key);
-        if (it == kvmap.end()) return;
-        kvcache.erase(it->second);
-        kvmap.erase(it);
+        auto it = dirty.find(key);
+        if (it == dirty.end()) return CLEAN;
+        if (it->second.op == DEL) return DIRTY_DELETE;
+        value = it->second.value;
+        expires_ms = it->second.expires_ms;
+        return DIRTY_PUT;
     }
-};
 
-// Postgres Database setup
-static const char* DB_CONNINFO =
-    "host=localhost port=5432 user=postgres password=postgres dbname=kvdb";
+    json stats() const {
+        lock_guard<mutex> lock(mtx);
+        return {{"dirty", dirty.size()}, {"durable_lsn", durable_lsn},
+                {"fsyncs", fsyncs.load()}, {"flushed", flushed.load()},
+                {"segments", closed.size() + 1}, {"failed", failed}};
+    }
+};
 
-thread_local PGconn* thread_conn = nullptr;
-thread_local std::chrono::steady_clock::time_point last_ping;
+// Cross-instance invalidation: a row trigger on kv_store NOTIFYs
+// kv_invalidate with "<instance>:<key>" for every write (see
+// db_install_invalidation_trigger). Each server LISTENs on a dedicated
+// connection, skips its own writes, which it already applied locally, and
+// hands the other keys to apply() deduplicated and in batches of at most
+// `batch`, so a burst of remote writes takes each shard lock once per batch
+// rather than once per key. Notifications sent while the connection was
+// down are lost, so after a reconnect apply_all() drops everything.
+class PeerInvalidator {
+    string instance;
+    size_t batch;
+    function<void(const vector<string>&)> apply;
+    function<void()> apply_all;
+    atomic<uint64_t> received{0}, own{0}, applied{0}, batches{0}, reconnects{0};
 
-PGconn* get_connection() {
-    using namespace std::chrono;
+    PGconn* listen_connection() {
+        PGconn* conn = PQconnectdb(DB_CONNINFO);
+        if (!conn || PQstatus(conn) != CONNECTION_OK) {
+            if (conn) PQfinish(conn);
+            return nullptr;
+        }
+        PGresult* res = PQexec(conn, "LISTEN kv_invalidate");
+        bool ok = res && PQresultStatus(res) == PGRES_COMMAND_OK;
+        if (res) PQclear(res);
+        if (!ok) {
+            cerr << "[Invalidate] LISTEN failed: " << PQerrorMessage(conn) << "\n";
+            PQfinish(conn);
+            return nullptr;
+        }
+        return conn;
+    }
 
-    if (!thread_conn || PQstatus(thread_conn) != CONNECTION_OK) {
-        if (thread_conn) {
-            PQfinish(thread_conn);
-            thread_conn = nullptr;
+    void flush(vector<string>& pending, unordered_set<string>& seen) {
+        for (size_t i = 0; i < pending.size(); i += batch) {
+            vector<string> chunk(pending.begin() + i,
+                                 pending.begin() + min(pending.size(), i + batch));
+            apply(chunk);
+            applied.fetch_add(chunk.size(), memory_order_relaxed);
+            batches.fetch_add(1, memory_order_relaxed);
+            this_thread::yield();
         }
-        thread_conn = PQconnectdb(DB_CONNINFO);
+        pending.clear();
+        seen.clear();
+    }
 
-        if (!thread_conn || PQstatus(thread_conn) != CONNECTION_OK) {
-            cerr << "PostgreSQL connection failed: "
-                 << (thread_conn ? PQerrorMessage(thread_conn) : "(null)") << endl;
-            if (thread_conn) { PQfinish(thread_conn); thread_conn = nullptr; }
-            return nullptr;
+    void run() {
+        bool first = true;
+        while (true) {
+            PGconn* conn = listen_connection();
+            if (!conn) {
+                this_thread::sleep_for(chrono::seconds(1));
+                continue;
+            }
+            if (!first) {
+                reconnects.fetch_add(1, memory_order_relaxed);
+                apply_all();
+            }
+            first = false;
+
+            vector<string> pending;
+            unordered_set<string> seen;
+            while (PQstatus(conn) == CONNECTION_OK) {
+                pollfd pfd = { PQsocket(conn), POLLIN, 0 };
+                // wait only while nothing is pending, so a batch goes out as
+                // soon as the burst that filled it has been read
+                int ready = poll(&pfd, 1, pending.empty() ? 1000 : 0);
+                if (ready < 0 && errno != EINTR) break;
+                if (ready > 0 && !PQconsumeInput(conn)) break;
+
+                while (PGnotify* n = PQnotifies(conn)) {
+                    received.fetch_add(1, memory_order_relaxed);
+                    string payload = n->extra;
+                    PQfreemem(n);
+                    size_t colon = payload.rfind(':');
+                    if (colon == string::npos) continue;
+                    if (payload.compare(0, colon, instance) == 0 && colon == instance.size()) {
+                        own.fetch_add(1, memory_order_relaxed);
+                        continue;
+                    }
+                    string key = payload.substr(colon + 1);
+                    if (seen.insert(key).second) pending.push_back(key);
+                }
+                if (!pending.empty() && (ready == 0 || pending.size() >= batch)) flush(pending, seen);
+            }
+            cerr << "[Invalidate] listener connection lost: " << PQerrorMessage(conn) << "\n";
+            flush(pending, seen);
+            PQfinish(conn);
         }
-        last_ping = steady_clock::now();
-        return thread_conn;
     }
 
-    auto now = steady_clock::now();
-    if (duration_cast<seconds>(now - last_ping).count() >= 5) {
-        PGresult* res = PQexec(thread_conn, "SELECT 1");
-        if (!res || PQresultStatus(res) != PGRES_TUPLES_OK) {
-            cerr << "[PG] Ping failed, reconnecting: "
-                 << PQerrorMessage(thread_conn) << endl;
-            if (res) PQclear(res);
-            PQfinish(thread_conn);
-            thread_conn = PQconnectdb(DB_CONNINFO);
+public:
+    PeerInvalidator(const string& instance, size_t batch,
+                     function<void(const vector<string>&)> apply, function<void()> apply_all)
+        : instance(instance), batch(max<size_t>(1, batch)), apply(apply), apply_all(apply_all) {}
+
+    void start() { thread([this] { run(); }).detach(); }
+
+    json stats() const {
+        return {{"instance", instance},
+                {"received", received.load(memory_order_relaxed)},
+                {"own", own.load(memory_order_relaxed)},
+                {"applied", applied.load(memory_order_relaxed)},
+                {"batches", batches.load(memory_order_relaxed)},
+                {"reconnects", reconnects.load(memory_order_relaxed)}};
+    }
+};
+
+// Startup options, passed as --name=value after the thread pool size
+struct ServerOptions {
+    int threads = 1;
+    size_t cache_bytes = 64ull << 20;
+    size_t resize_step_bytes = 256 << 10;
+    size_t cache_shards = 0;    // 0 = one shard per worker thread
+    string cache_engine = "lru";
+    size_t slab_slot_bytes = 256;
+    bool huge_pages = false;
+    size_t compress_min_bytes = 0;  // 0 = values stored uncompressed
+    long negative_ttl_ms = 2000;
+    size_t negative_entries = 100000;
+    size_t near_entries = 256;  // per worker thread, 0 = no near cache
+    double mrc_sample = 0.01;   // 0 = no miss ratio curve
+    size_t mrc_keys = 8192;
+    size_t hot_counters = 1024;  // 0 = no hot-key tracking
+    uint32_t hot_sample = 16;
+    long hot_window_s = 10;
+    long ttl_tick_ms = 10;
+    long reap_interval_ms = 1000;
+    long reap_batch = 1000;
+    string warm_file;           // empty = no warm-up
+    long warm_interval_s = 60;
+    size_t warm_keys = 100000;
+    size_t warm_batch = 1000;
+    bool warm_block = false;
+    bool write_back = false;
+    string journal_path = "kvserver.journal";
+    long flush_interval_ms = 50;
+    size_t flush_batch = 1000;
+    bool peer_invalidation = false;
+    size_t invalidate_batch = 256;
+    bool migrate_bytea = false;
+    size_t db_pool_min = 0;     // 0 = thread_pool_size
+    size_t db_pool_max = 0;     // 0 = thread_pool_size
+    long db_pool_timeout_ms = 1000;
+    size_t db_pipeline_connections = 0;  // 0 = each worker queries on its own connection
+    size_t db_pipeline_depth = 256;
+    bool db_async = false;
+    string flash_path;          // empty = no flash tier
+    size_t flash_bytes = 1ull << 30;
+    size_t flash_segment_bytes = 1 << 20;
+};
+
+static void print_usage(const char* prog) {
+    cerr << "Usage: " << prog << " <thread_pool_size> [options]\n"
+         << "  --cache-bytes=N  cache memory budget, suffixes K/M/G allowed (default 64M)\n"
+         << "  --shards=N       number of cache shards (default = thread_pool_size)\n"
+         << "  --resize-step=N  bytes evicted per shard per step when shrinking at runtime (default 256K)\n"
+         << "  --cache=ENGINE   eviction engine: lru | slru | arc | tinylfu | clock |\n"
+         << "                   lru-epoch | slab (default lru)\n"
+         << "  --slab-slot=N    slab engine: bytes of key + value per entry (default 256)\n"
+         << "  --hugepages=0|1  slab engine: back the slab with huge pages (default 0)\n"
+         << "  --compress-min=N compress cached values of at least N bytes, 0 disables (default 0)\n"
+         << "  --neg-ttl-ms=N   how long a missing key is remembered, 0 disables (default 2000)\n"
+         << "  --neg-entries=N  max remembered missing keys (default 100000)\n"
+         << "  --near-entries=N per-thread near cache entries, 0 disables (default 256)\n"
+         << "  --mrc-sample=R   fraction of keys sampled for the miss ratio curve, 0 disables (default 0.01)\n"
+         << "  --mrc-keys=N     max keys tracked for the miss ratio curve (default 8192)\n"
+         << "  --hot-counters=N keys tracked by the hot-key sketch, 0 disables (default 1024)\n"
+         << "  --hot-sample=N   feed 1 in N accesses to the hot-key sketch (default 16)\n"
+         << "  --hot-window-s=N seconds per hot-key counting window (default 10)\n"
+         << "  --ttl-tick-ms=N  resolution of cache expiry for keys with a TTL (default 10)\n"
+         << "  --reap-interval-ms=N  pause between DB sweeps of expired rows (default 1000)\n"
+         << "  --reap-batch=N   expired rows deleted per statement (default 1000)\n"
+         << "  --warm-file=PATH save hot keys here and preload them at startup (default off)\n"
+         << "  --warm-interval-s=N  seconds between hot key snapshots (default 60)\n"
+         << "  --warm-keys=N    hot keys kept in a snapshot (default 100000)\n"
+         << "  --warm-batch=N   keys fetched per DB query while warming (default 1000)\n"
+         << "  --warm-block=0|1 finish warming before accepting traffic (default 0)\n"
+         << "  --write-back=0|1 journal writes locally and flush them to the DB asynchronously (default 0)\n"
+         << "  --journal=PATH   write-back journal segment prefix (default kvserver.journal)\n"
+         << "  --flush-interval-ms=N  pause between write-back flushes (default 50)\n"
+         << "  --peer-invalidation=0|1  drop keys written by other servers via LISTEN/NOTIFY (default 0)\n"
+         << "  --invalidate-batch=N  peer invalidations applied per batch (default 256)\n"
+         << "  --migrate-bytea=0|1  convert a text kv_store.value column to bytea at startup (default 0)\n"
+         << "  --flush-batch=N  changes applied per flush transaction (default 1000)\n"
+         << "  --db-pool-min=N  DB connections opened at startup (default = thread_pool_size)\n"
+         << "  --db-pool-max=N  max DB connections shared by all threads (default = thread_pool_size)\n"
+         << "  --db-pool-timeout-ms=N  how long a request waits for a free DB connection, pooled or pipelined (default 1000)\n"
+         << "  --db-pipeline=N  send reads and writes over N pipelined connections, 0 disables (default 0)\n"
+         << "  --pipeline-depth=N  max statements in flight per pipelined connection (default 256)\n"
+         << "  --db-async=0|1   handlers don't wait for Postgres; uses the --db-pipeline connections, at least 1 (default 0)\n"
+         << "  --flash-path=PATH  keep entries evicted from memory in this SSD file (default off)\n"
+         << "  --flash-bytes=N  size of the flash tier file (default 1G)\n"
+         << "  --flash-segment=N  bytes per sequential flash write (default 1M)\n";
+}
+
+unique_ptr<KVCache> make_engine(const ServerOptions& opts) {
+    const string& e = opts.cache_engine;
+    size_t n = opts.cache_shards, cap = opts.cache_bytes;
+    if (e == "lru") return unique_ptr<KVCache>(new ShardedCache<LRUCache>(n, cap));
+    if (e == "slru") return unique_ptr<KVCache>(new ShardedCache<SLRUCache>(n, cap));
+    if (e == "arc") return unique_ptr<KVCache>(new ShardedCache<ARCCache>(n, cap));
+    if (e == "tinylfu") return unique_ptr<KVCache>(new ShardedCache<TinyLFUCache>(n, cap));
+    if (e == "clock") return unique_ptr<KVCache>(new ShardedCache<ClockCache>(n, cap));
+    if (e == "lru-epoch") return unique_ptr<KVCache>(new ShardedCache<EpochLRUCache>(n, cap));
+    if (e == "slab")
+        return unique_ptr<KVCache>(new ShardedCache<SlabLRUCache>(n, cap, opts.slab_slot_bytes,
+                                                                  opts.huge_pages));
+    return nullptr;
+}
+
+unique_ptr<KVCache> make_cache(const ServerOptions& opts) {
+    unique_ptr<KVCache> engine = make_engine(opts);
+    if (!engine || opts.compress_min_bytes == 0) return engine;
+    return unique_ptr<KVCache>(new CompressedCache(move(engine), opts.compress_min_bytes));
+}
+
+// "4G", "512M", "64K" or a plain byte count
+size_t parse_bytes(const string& s) {
+    size_t pos = 0;
+    unsigned long long n = stoull(s, &pos);
+    string suffix = s.substr(pos);
+    if (suffix.empty() || suffix == "B") return n;
+    if (suffix == "K" || suffix == "KB") return n << 10;
+    if (suffix == "M" || suffix == "MB") return n << 20;
+    if (suffix == "G" || suffix == "GB") return n << 30;
+    throw invalid_argument("bad size suffix");
+}
 
-            if (!thread_conn || PQstatus(thread_conn) != CONNECTION_OK) {
-                cerr << "[PG] Reconnect failed: "
-                     << (thread_conn ? PQerrorMessage(thread_conn) : "(null)") << endl;
-                if (thread_conn) { PQfinish(thread_conn); thread_conn = nullptr; }
-                return nullptr;
+bool parse_options(int argc, char* argv[], ServerOptions& opts) {
+    if (argc < 2) return false;
+    try { opts.threads = stoi(argv[1]); } catch (...) { opts.threads = 1; }
+
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || eq == string::npos) {
+            cerr << "Invalid option: " << arg << "\n";
+            return false;
+        }
+        string name = arg.substr(2, eq - 2);
+        string val = arg.substr(eq + 1);
+        try {
+            if (name == "cache-bytes") opts.cache_bytes = parse_bytes(val);
+            else if (name == "shards") opts.cache_shards = stoull(val);
+            else if (name == "resize-step") opts.resize_step_bytes = max<size_t>(1, parse_bytes(val));
+            else if (name == "cache") opts.cache_engine = val;
+            else if (name == "slab-slot") opts.slab_slot_bytes = stoull(val);
+            else if (name == "hugepages") opts.huge_pages = stoi(val) != 0;
+            else if (name == "compress-min") opts.compress_min_bytes = parse_bytes(val);
+            else if (name == "neg-ttl-ms") opts.negative_ttl_ms = stol(val);
+            else if (name == "neg-entries") opts.negative_entries = stoull(val);
+            else if (name == "near-entries") opts.near_entries = stoull(val);
+            else if (name == "mrc-sample") opts.mrc_sample = stod(val);
+            else if (name == "mrc-keys") opts.mrc_keys = max<size_t>(1, stoull(val));
+            else if (name == "hot-counters") opts.hot_counters = stoull(val);
+            else if (name == "hot-sample") opts.hot_sample = max(1, stoi(val));
+            else if (name == "hot-window-s") opts.hot_window_s = max(1L, stol(val));
+            else if (name == "ttl-tick-ms") opts.ttl_tick_ms = max(1L, stol(val));
+            else if (name == "reap-interval-ms") opts.reap_interval_ms = max(1L, stol(val));
+            else if (name == "reap-batch") opts.reap_batch = max(1L, stol(val));
+            else if (name == "warm-file") opts.warm_file = val;
+            else if (name == "warm-interval-s") opts.warm_interval_s = max(1L, stol(val));
+            else if (name == "warm-keys") opts.warm_keys = stoull(val);
+            else if (name == "warm-batch") opts.warm_batch = max<size_t>(1, stoull(val));
+            else if (name == "warm-block") opts.warm_block = stoi(val) != 0;
+            else if (name == "write-back") opts.write_back = stoi(val) != 0;
+            else if (name == "journal") opts.journal_path = val;
+            else if (name == "flush-interval-ms") opts.flush_interval_ms = max(1L, stol(val));
+            else if (name == "flush-batch") opts.flush_batch = max<size_t>(1, stoull(val));
+            else if (name == "peer-invalidation") opts.peer_invalidation = stoi(val) != 0;
+            else if (name == "migrate-bytea") opts.migrate_bytea = stoi(val) != 0;
+            else if (name == "invalidate-batch") opts.invalidate_batch = max<size_t>(1, stoull(val));
+            else if (name == "db-pool-min") opts.db_pool_min = stoull(val);
+            else if (name == "db-pool-max") opts.db_pool_max = stoull(val);
+            else if (name == "db-pool-timeout-ms") opts.db_pool_timeout_ms = max(1L, stol(val));
+            else if (name == "db-pipeline") opts.db_pipeline_connections = stoull(val);
+            else if (name == "pipeline-depth") opts.db_pipeline_depth = max<size_t>(1, stoull(val));
+            else if (name == "db-async") opts.db_async = stoi(val) != 0;
+            else if (name == "flash-path") opts.flash_path = val;
+            else if (name == "flash-bytes") opts.flash_bytes = parse_bytes(val);
+            else if (name == "flash-segment") opts.flash_segment_bytes = parse_bytes(val);
+            else {
+                cerr << "Unknown option: --" << name << "\n";
+                return false;
             }
+        } catch (...) {
+            cerr << "Invalid value for --" << name << ": " << val << "\n";
+            return false;
         }
-        if (res) PQclear(res);
-        last_ping = now;
     }
+    if (opts.cache_shards == 0) opts.cache_shards = max(opts.threads, 1);
+    if (opts.db_async && opts.db_pipeline_connections == 0) opts.db_pipeline_connections = 1;
+    if (opts.db_pool_max == 0) opts.db_pool_max = max(opts.threads, 1);
+    if (opts.db_pool_min == 0) opts.db_pool_min = max(opts.threads, 1);
+    opts.db_pool_min = min(opts.db_pool_min, opts.db_pool_max);
+    return true;
+}
+
+
+// main code
+
+unique_ptr<KVCache> cache;
+unique_ptr<NegativeCache> negative_cache;
+unique_ptr<NearCache> near_cache;
+unique_ptr<MissRatioCurve> miss_curve;
+unique_ptr<HotKeys> heavy_hitters;
 
-    return thread_conn;
+// runtime cache resizing: each request gets a generation and a newer one
+// stops an older shrink that is still in progress. Resizes run one at a
+// time, so a newer one reads the shard budgets only after the older one's
+// last step has landed.
+atomic<uint64_t> resize_generation{0};
+mutex resize_mtx;
+atomic<size_t> resize_target{0};
+atomic<bool> resize_running{false};
+
+void start_resize(size_t capacity_bytes, size_t step_bytes) {
+    uint64_t gen = ++resize_generation;
+    resize_target = capacity_bytes;
+    resize_running = true;
+    thread([capacity_bytes, step_bytes, gen]{
+        lock_guard<mutex> lock(resize_mtx);
+        if (resize_generation.load() != gen) return;
+        auto start = chrono::steady_clock::now();
+        bool done = cache->set_capacity(capacity_bytes, step_bytes,
+                                        [gen] { return resize_generation.load() != gen; });
+        if (!done) return;
+        resize_running = false;
+        auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+        cout << "[Cache] capacity set to " << capacity_bytes << " bytes in " << ms.count() << " ms\n";
+    }).detach();
 }
+unique_ptr<SingleFlight> inflight_reads;
+unique_ptr<TimerWheel> expiry_wheel;
+unique_ptr<CacheWarmer> warmer;
+unique_ptr<WriteBackJournal> write_back;     // null unless --write-back=1
+unique_ptr<PeerInvalidator> peer_invalidator;   // null unless --peer-invalidation=1
+unique_ptr<FlashTier> flash;                    // null unless --flash-path is set
+KeyVersions key_versions;
 
-// JSON setup
-static std::string to_string_json_value(const nlohmann::json &v) {
-    if (v.is_string()) return v.get<std::string>();
-    if (v.is_number_integer()) return std::to_string(v.get<long long>());
-    if (v.is_number_unsigned()) return std::to_string(v.get<unsigned long long>());
-    if (v.is_number_float()) {
-        std::ostringstream ss;
-        ss << v.get<double>();
-        return ss.str();
+// Puts a value read from the DB into the cache. stamp is the key's version
+// taken before the read; if a write committed since, the entry may be stale
+// and is dropped again (a later write's own put always lands after this).
+void fill_cache(const string& key, const string& value, int64_t ttl_ms, uint64_t stamp) {
+    cache->put(key, value);
+    if (ttl_ms > 0) expiry_wheel->schedule(key, ttl_ms);
+    if (key_versions.get(key) != stamp) {
+        cache->remove(key);
+        key_versions.bump(key);     // near caches may have copied the stale value
     }
-    return v.dump();
 }
 
-// JSON to integer
-bool jstonToInt(const nlohmann::json &v, int &out) {
-    try {
-        if (v.is_number_integer()) {
-            out = v.get<int>();
-            return true;
-        }
-        if (v.is_string()) {
-            std::string s = v.get<std::string>();
-            if (s.empty()) return false;
-            size_t pos = 0;
-            long long val = std::stoll(s, &pos);
-            if (pos != s.size()) return false;
-            out = (int)val;
-            return true;
+static int64_t epoch_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Cache miss path: pending write-back changes first, then the flash tier,
+// then the DB. Fills the cache on a hit and the negative cache when the key
+// is absent.
+// The steps before the DB: true if they settled the read (result in res)
+static bool read_local(int key_num, const string& key, string& out,
+                       uint64_t ticket, uint64_t stamp, DbResult& res) {
+    if (write_back) {
+        int64_t expires_ms = 0;
+        auto state = write_back->lookup(key_num, out, expires_ms);
+        if (state == WriteBackJournal::DIRTY_PUT) {
+            int64_t now = epoch_ms();
+            if (expires_ms == 0 || expires_ms > now) {
+                fill_cache(key, out, expires_ms ? expires_ms - now : 0, stamp);
+                res = DB_OK;
+                return true;
+            }
         }
-        if (v.is_number_float()) {
-            out = static_cast<int>(v.get<double>());
+        if (state != WriteBackJournal::CLEAN) {
+            negative_cache->insert(key, ticket);
+            res = DB_NOT_FOUND;
             return true;
         }
-    } catch (...) { }
+    }
+
+    // a key with a TTL still has its timer on the wheel, so no TTL here
+    if (flash && flash->get(key, stamp, out)) {
+        fill_cache(key, out, 0, stamp);
+        res = DB_OK;
+        return true;
+    }
     return false;
 }
 
-// convert route path from string to integer
-bool strToInt(const std::string &s, int &out) {
-    try {
-        if (s.empty()) return false;
-        size_t pos = 0;
-        long long val = std::stoll(s, &pos);
-        if (pos != s.size()) return false;
-        out = (int)val;
-        return true;
-    } catch (...) { return false; }
+static void read_fill(const string& key, uint64_t ticket, uint64_t stamp,
+                      DbResult res, const string& value, int64_t ttl_ms) {
+    if (res == DB_OK) fill_cache(key, value, ttl_ms, stamp);
+    else if (res == DB_NOT_FOUND) negative_cache->insert(key, ticket);
 }
 
-// Database operations
-bool db_create(int key, const std::string& value) {
-    PGconn* conn = get_connection();
-    if (!conn) return false;
+DbResult read_through(int key_num, const string& key, string& out) {
+    uint64_t ticket = negative_cache->ticket(key);
+    uint64_t stamp = key_versions.get(key);
+    DbResult res;
+    if (read_local(key_num, key, out, ticket, stamp, res)) return res;
 
-    std::string keystr = std::to_string(key);
-    const char *paramValues[2] = { keystr.c_str(), value.c_str() };
+    int64_t ttl_ms = 0;
+    res = db_read(key_num, out, &ttl_ms);
+    read_fill(key, ticket, stamp, res, out, ttl_ms);
+    return res;
+}
 
-    PGresult* res = PQexecParams(conn,
-        "INSERT INTO kv_store(\"key\", value) VALUES ($1::bigint, $2) "
-        "ON CONFLICT (\"key\") DO UPDATE SET value = EXCLUDED.value",
-        2,            
-        NULL,         
-        paramValues,
-        NULL,         
-        NULL,         
-        0);           
-    if (!res) {
-        cerr << "[DB] null result: " << PQerrorMessage(conn) << "\n";
-        return false;
+// read_through for --db-async: done(result, value) runs once the read is
+// settled, on the DB loop thread if it had to wait for Postgres
+void read_through_async(int key_num, const string& key,
+                        function<void(DbResult, const string&)> done) {
+    uint64_t ticket = negative_cache->ticket(key);
+    uint64_t stamp = key_versions.get(key);
+    string out;
+    DbResult res;
+    if (read_local(key_num, key, out, ticket, stamp, res)) {
+        done(res, out);
+        return;
     }
-    bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK);
-    if (!ok) cerr << "[DB] Insert/Update failed: " << PQerrorMessage(conn) << "\n";
-    PQclear(res);
-    return ok;
+    db_read_async(key_num, [key, ticket, stamp, done](DbResult r, const string& value, int64_t ttl_ms) {
+        read_fill(key, ticket, stamp, r, value, ttl_ms);
+        done(r, value);
+    });
 }
 
-bool db_read(int key, std::string& value) {
-    PGconn* conn = get_connection();
-    if (!conn) return false;
-
-    std::string keystr = std::to_string(key);
-    const char *paramValues[1] = { keystr.c_str() };
+// Route helpers. Handlers take the response by reference so that, with
+// --db-async, they can return before it is complete; whoever finishes it
+// calls reply(). Completions arriving on another thread go through
+// post_to() to the connection's own io thread first.
+static void reply(crow::response& res, int code, std::string body) {
+    res.code = code;
+    res.body = std::move(body);
+    res.end();
+}
 
-    PGresult* res = PQexecParams(conn,
-        "SELECT value FROM kv_store WHERE \"key\" = $1::bigint",
-        1, NULL, paramValues, NULL, NULL, 0);
+template <class F>
+static void post_to(crow::asio::io_context* io, F f) {
+    crow::asio::post(*io, std::move(f));
+}
 
-    if (!res) {
-        cerr << "[DB] null result from read: " << PQerrorMessage(conn) << "\n";
-        return false;
+static void finish_create(crow::response& res, int key_num, const std::string& value, int ttl, bool done) {
+    if (done) {
+        std::string key = std::to_string(key_num);
+        key_versions.bump(key);
+        negative_cache->invalidate(key);
+        inflight_reads->forget(key);
+        cache->put(key, value);
+        if (ttl > 0) expiry_wheel->schedule(key, ttl * 1000LL);
+        else expiry_wheel->cancel(key);
+        key_versions.bump(key);
+        miss_curve->access(key, value.size());
     }
+    reply(res, done ? 200 : 500, done ? "Created" : "DB Error");
+}
 
-    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
-        PQclear(res);
-        return false;
+static void finish_read(crow::response& res, const std::string& key, DbResult r, const std::string& value) {
+    if (r == DB_OK) {
+        miss_curve->access(key, value.size());
+        return reply(res, 200, value);
     }
+    if (r == DB_ERROR) return reply(res, 500, "DB Error");
+    reply(res, 404, "Not found");
+}
 
-    char *val = PQgetvalue(res, 0, 0);
-    if (val) value = val;
-    PQclear(res);
-    return true;
+static void finish_delete(crow::response& res, const std::string& key, uint64_t ticket, bool done) {
+    if (done) {
+        key_versions.bump(key);
+        inflight_reads->forget(key);
+        cache->remove(key);
+        expiry_wheel->cancel(key);
+        key_versions.bump(key);
+        negative_cache->insert(key, ticket);
+        miss_curve->forget(key);
+    }
+    reply(res, done ? 200 : 500, done ? "Deleted" : "Not found");
 }
 
-bool db_delete(int key) {
-    PGconn* conn = get_connection();
-    if (!conn) return false;
+int main(int argc, char* argv[]) {
+    ServerOptions opts;
+    if (!parse_options(argc, argv, opts)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    int threads = opts.threads;
+    if (opts.peer_invalidation) {
+        random_device rd;
+        char tag[17];
+        snprintf(tag, sizeof(tag), "%08x%08x", rd(), rd());
+        db_instance_tag = tag;
+    }
+    cache = make_cache(opts);
+    if (!cache) {
+        cerr << "Unknown cache engine: " << opts.cache_engine << "\n";
+        print_usage(argv[0]);
+        return 1;
+    }
+    negative_cache.reset(new NegativeCache(opts.cache_shards, chrono::milliseconds(opts.negative_ttl_ms),
+                                           opts.negative_entries));
+    near_cache.reset(new NearCache(opts.near_entries));
+    miss_curve.reset(new MissRatioCurve(opts.mrc_sample, opts.mrc_keys));
+    heavy_hitters.reset(new HotKeys(opts.hot_counters, opts.hot_sample, chrono::seconds(opts.hot_window_s)));
+    resize_target = opts.cache_bytes;
+    inflight_reads.reset(new SingleFlight(opts.cache_shards));
+    expiry_wheel.reset(new TimerWheel(chrono::milliseconds(opts.ttl_tick_ms)));
 
-    std::string keystr = std::to_string(key);
-    const char *paramValues[1] = { keystr.c_str() };
+    db_pool.reset(new ConnectionPool(opts.db_pool_min, opts.db_pool_max,
+                                     chrono::milliseconds(opts.db_pool_timeout_ms)));
 
-    PGresult* res = PQexecParams(conn,
-        "DELETE FROM kv_store WHERE \"key\" = $1::bigint",
-        1, NULL, paramValues, NULL, NULL, 0);
+    // before anything else touches kv_store, including journal replay
+    if (!db_ensure_schema())
+        cerr << "[DB] kv_store schema could not be checked; TTL columns may be missing\n";
+    {
+        string type = db_value_type();
+        if (!type.empty() && type != "bytea" && opts.migrate_bytea && db_migrate_value_to_bytea())
+            type = db_value_type();
+        if (type.empty()) {
+            cerr << "[DB] kv_store.value type unknown; make sure it is bytea\n";
+        } else if (type != "bytea") {
+            cerr << "[DB] kv_store.value is " << type << ", but values are stored as bytea; "
+                 << "convert it with --migrate-bytea=1 (see Readme.md)\n";
+            return 1;
+        }
+    }
 
-    if (!res) {
-        cerr << "[DB] null result from delete: " << PQerrorMessage(conn) << "\n";
-        return false;
+    // also after the schema check, for the same reason as the pipeline below
+    {
+        auto start = chrono::steady_clock::now();
+        size_t opened = db_pool->prewarm();
+        auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+        cout << "[DB] pool: " << opened << "/" << opts.db_pool_min << " connections opened in "
+             << ms.count() << " ms (max " << opts.db_pool_max << ")\n";
     }
 
-    bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK && atoi(PQcmdTuples(res)) > 0);
-    PQclear(res);
-    return ok;
-}
+    // after the schema check, so its connections prepare against the final columns
+    if (opts.db_pipeline_connections > 0) {
+        db_pipeline.reset(new DbPipeline(opts.db_pipeline_connections, opts.db_pipeline_depth,
+                                         chrono::milliseconds(opts.db_pool_timeout_ms)));
+        db_pipeline->start();
+        db_async = opts.db_async;
+    }
 
-// main code
+    if (opts.write_back) {
+        write_back.reset(new WriteBackJournal(opts.journal_path, opts.flush_batch,
+                                              chrono::milliseconds(opts.flush_interval_ms)));
+        if (!write_back->start()) {
+            cerr << "[Journal] cannot start write-back journal at " << opts.journal_path << "\n";
+            return 1;
+        }
+    }
 
-LRUCache cache(100);
+    if (!opts.flash_path.empty()) {
+        flash.reset(new FlashTier(opts.flash_path, opts.flash_bytes, opts.flash_segment_bytes));
+        if (!flash->start()) {
+            cerr << "[Flash] cannot open flash tier file " << opts.flash_path << "\n";
+            return 1;
+        }
+        cache->set_eviction_sink([](const string& key, const string& value) {
+            flash->stage(key, value, key_versions.get(key));
+        });
+    }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        cerr << "Usage: " << argv[0] << " <thread_pool_size>\n";
-        return 1;
+    if (opts.peer_invalidation) {
+        if (!db_install_invalidation_trigger())
+            cerr << "[Invalidate] trigger missing; writes may not reach other servers\n";
+        // stamps are bumped around the removal like a local write, so near
+        // caches and in-flight fills drop what they copied (see fill_cache)
+        auto apply = [](const vector<string>& keys) {
+            for (auto& key : keys) key_versions.bump(key);
+            cache->remove_batch(keys);
+            for (auto& key : keys) {
+                key_versions.bump(key);
+                negative_cache->invalidate(key);
+                inflight_reads->forget(key);
+            }
+        };
+        auto apply_all = [apply, opts]{
+            key_versions.bump_all();
+            negative_cache->clear();
+            size_t entries = 0;
+            for (auto& s : cache->shard_stats()) entries += s.entries;
+            // hot_keys splits its limit evenly, so ask for every shard's worth
+            vector<string> keys = cache->hot_keys((entries + 1) * cache->shard_count());
+            for (size_t i = 0; i < keys.size(); i += opts.invalidate_batch) {
+                apply(vector<string>(keys.begin() + i,
+                                     keys.begin() + min(keys.size(), i + opts.invalidate_batch)));
+                this_thread::yield();
+            }
+        };
+        peer_invalidator.reset(new PeerInvalidator(db_instance_tag, opts.invalidate_batch,
+                                                   apply, apply_all));
+        peer_invalidator->start();
     }
 
-    int threads = 1;
-    try { threads = stoi(argv[1]); } catch (...) { threads = 1; }
+    // cache side of TTLs: drop entries as their timers fire
+    thread([]{
+        while (true) {
+            this_thread::sleep_for(expiry_wheel->tick_length());
+            for (auto& key : expiry_wheel->advance()) {
+                cache->remove(key);
+                key_versions.bump(key);
+            }
+        }
+    }).detach();
+
+    // database side of TTLs: delete expired rows in bounded batches
+    thread([opts]{
+        while (true) {
+            this_thread::sleep_for(chrono::milliseconds(opts.reap_interval_ms));
+            while (db_reap_expired(opts.reap_batch) == opts.reap_batch) { }
+        }
+    }).detach();
+
+    warmer.reset(new CacheWarmer(opts.warm_file));
+    if (warmer->enabled()) {
+        auto warm = [opts]{
+            auto start = chrono::steady_clock::now();
+            warmer->warm(opts.warm_batch,
+                         [](const string& key) { return key_versions.get(key); },
+                         [](const string& key, const string& value, int64_t ttl_ms, uint64_t stamp) {
+                             // rows with unflushed changes would load stale values
+                             string pending;
+                             int64_t exp;
+                             if (write_back && write_back->lookup(stoi(key), pending, exp) !=
+                                               WriteBackJournal::CLEAN)
+                                 return;
+                             fill_cache(key, value, ttl_ms, stamp);
+                         });
+            auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+            cout << "[Warmup] loaded " << warmer->progress()["loaded"] << " keys in "
+                 << ms.count() << " ms\n";
+        };
+        if (opts.warm_block) warm();
+        else thread(warm).detach();
+
+        thread([opts]{
+            while (true) {
+                this_thread::sleep_for(chrono::seconds(opts.warm_interval_s));
+                if (!warmer->save(cache->hot_keys(opts.warm_keys)))
+                    cerr << "[Warmup] failed to save hot keys to " << opts.warm_file << "\n";
+            }
+        }).detach();
+    }
 
     crow::SimpleApp app;
 
     CROW_ROUTE(app, "/create").methods("POST"_method)
-    ([](const crow::request& req){
-        if (req.body.empty()) return crow::response(400, "Empty body");
+    ([](const crow::request& req, crow::response& res){
+        if (req.body.empty()) return reply(res, 400, "Empty body");
 
         nlohmann::json j;
         try {
             j = nlohmann::json::parse(req.body);
         } catch (const nlohmann::json::parse_error &e) {
             cerr << "[JSON] parse error: " << e.what() << " payload: " << req.body << "\n";
-            return crow::response(400, "Invalid JSON");
+            return reply(res, 400, "Invalid JSON");
         }
 
         if (!j.contains("key") || !j.contains("value")) {
-            return crow::response(400, "Missing key or value");
+            return reply(res, 400, "Missing key or value");
         }
 
         int key_num;
         if (!jstonToInt(j["key"], key_num)) {
-            return crow::response(400, "Invalid key (expected integer)");
+            return reply(res, 400, "Invalid key (expected integer)");
+        }
+
+        int ttl = 0;
+        if (j.contains("ttl") && (!jstonToInt(j["ttl"], ttl) || ttl <= 0)) {
+            return reply(res, 400, "Invalid ttl (expected positive seconds)");
         }
 
         std::string value = to_string_json_value(j["value"]);
-        bool done = db_create(key_num, value);
-        if (done) cache.put(std::to_string(key_num), value);
-        return crow::response(done ? 200 : 500, done ? "Created" : "DB Error");
+        heavy_hitters->record(std::to_string(key_num), HotKeys::WRITE);
+        if (write_back) {
+            int64_t expires_ms = ttl > 0 ? epoch_ms() + ttl * 1000LL : 0;
+            bool done = write_back->append(WriteBackJournal::PUT, key_num, value, expires_ms);
+            return finish_create(res, key_num, value, ttl, done);
+        }
+        if (db_async) {
+            crow::asio::io_context* io = req.io_context;
+            return db_create_async(key_num, value, ttl, [io, &res, key_num, value, ttl](bool done) {
+                post_to(io, [&res, key_num, value, ttl, done] {
+                    finish_create(res, key_num, value, ttl, done);
+                });
+            });
+        }
+        finish_create(res, key_num, value, ttl, db_create(key_num, value, ttl));
     });
 
     CROW_ROUTE(app, "/read/<string>")
-    ([](const std::string &key_path){
+    ([](const crow::request& req, crow::response& res, const std::string &key_path){
+        int key_num;
+        if (!strToInt(key_path, key_num)) return reply(res, 400, "Invalid key");
+        // canonical form, so "007" and "7" share cache entries and invalidations
+        std::string key = std::to_string(key_num);
+
         std::string value;
-        bool hit = cache.get(key_path, value);
-        if (hit) return crow::response(200, value);
+        uint64_t stamp = key_versions.get(key);
+        if (near_cache->get(key, stamp, value)) {
+            heavy_hitters->record(key, HotKeys::HIT);
+            miss_curve->access(key, value.size());
+            return reply(res, 200, value);
+        }
+        bool hit = cache->get(key, value);
+        if (hit) {
+            near_cache->put(key, value, stamp);
+            heavy_hitters->record(key, HotKeys::HIT);
+            miss_curve->access(key, value.size());
+            return reply(res, 200, value);
+        }
+        heavy_hitters->record(key, HotKeys::MISS);
 
-        int key_num;
-        if (!strToInt(key_path, key_num)) return crow::response(400, "Invalid key");
+        if (negative_cache->contains(key)) return reply(res, 404, "Not found");
 
-        if (db_read(key_num, value)) {
-            cache.put(key_path, value);
-            return crow::response(200, value);
+        if (db_async) {
+            crow::asio::io_context* io = req.io_context;
+            return inflight_reads->run_async(key,
+                [key_num, key](SingleFlight::Callback fetched) {
+                    read_through_async(key_num, key, fetched);
+                },
+                [io, &res, key](DbResult r, const std::string& value) {
+                    post_to(io, [&res, key, r, value] { finish_read(res, key, r, value); });
+                });
         }
-        return crow::response(404, "Not found");
+        DbResult r = inflight_reads->run(key, value, [&](std::string& out) {
+            return read_through(key_num, key, out);
+        });
+        finish_read(res, key, r, value);
     });
 
     CROW_ROUTE(app, "/delete/<string>").methods("DELETE"_method)
-    ([](const std::string &key_path){
+    ([](const crow::request& req, crow::response& res, const std::string &key_path){
         int key_num;
-        if (!strToInt(key_path, key_num)) return crow::response(400, "Invalid key");
+        if (!strToInt(key_path, key_num)) return reply(res, 400, "Invalid key");
+        std::string key = std::to_string(key_num);
 
-        bool done = db_delete(key_num);
-        if (done) cache.remove(key_path);
-        return crow::response(done ? 200 : 500, done ? "Deleted" : "Not found");
+        uint64_t ticket = negative_cache->ticket(key);
+        // write-back acknowledges deletes without checking the row exists
+        if (write_back)
+            return finish_delete(res, key, ticket, write_back->append(WriteBackJournal::DEL, key_num, "", 0));
+        if (db_async) {
+            crow::asio::io_context* io = req.io_context;
+            return db_delete_async(key_num, [io, &res, key, ticket](bool done) {
+                post_to(io, [&res, key, ticket, done] { finish_delete(res, key, ticket, done); });
+            });
+        }
+        finish_delete(res, key, ticket, db_delete(key_num));
+    });
+
+    // readiness: 503 until the startup cache warm-up has finished
+    CROW_ROUTE(app, "/ready")
+    ([](){
+        json j = warmer->progress();
+        return crow::response(warmer->done() ? 200 : 503, j.dump());
+    });
+
+    // estimated LRU hit ratio at other cache sizes, from sampled live traffic
+    CROW_ROUTE(app, "/admin/mrc")
+    ([](){
+        size_t capacity = 0;
+        for (auto& s : cache->shard_stats()) capacity += s.capacity_bytes;
+        return crow::response(200, miss_curve->curve(capacity).dump());
+    });
+
+    // grow or shrink the cache budget while serving:
+    // POST /admin/cache/capacity {"bytes": 268435456} or {"bytes": "256M"}
+    CROW_ROUTE(app, "/admin/cache/capacity").methods("GET"_method, "POST"_method)
+    ([opts](const crow::request& req){
+        if (req.method == "POST"_method) {
+            long long bytes = 0;
+            try {
+                json j = json::parse(req.body);
+                if (j.at("bytes").is_string()) bytes = parse_bytes(j["bytes"].get<string>());
+                else bytes = j.at("bytes").get<long long>();
+            } catch (...) {
+                return crow::response(400, "Expected {\"bytes\": N}");
+            }
+            if (bytes <= 0) return crow::response(400, "Capacity must be positive");
+            start_resize(bytes, opts.resize_step_bytes);
+        }
+        size_t capacity = 0, used = 0;
+        for (auto& s : cache->shard_stats()) {
+            capacity += s.capacity_bytes;
+            used += s.bytes;
+        }
+        json j = {{"capacity_bytes", capacity}, {"bytes", used},
+                  {"target_bytes", resize_target.load()}, {"resizing", resize_running.load()}};
+        return crow::response(req.method == "POST"_method ? 202 : 200, j.dump());
+    });
+
+    // most accessed keys in the last window: GET /admin/hotkeys?k=N
+    CROW_ROUTE(app, "/admin/hotkeys")
+    ([](const crow::request& req){
+        int k = 10;
+        const char* param = req.url_params.get("k");
+        if (param && (!strToInt(param, k) || k <= 0)) return crow::response(400, "Invalid k");
+        return crow::response(200, heavy_hitters->top(k).dump());
+    });
+
+    CROW_ROUTE(app, "/metrics")
+    ([](){
+        json j;
+        CacheStats total;
+        json shards = json::array();
+        for (auto& s : cache->shard_stats()) {
+            total.hits += s.hits;
+            total.misses += s.misses;
+            total.evictions += s.evictions;
+            total.entries += s.entries;
+            total.bytes += s.bytes;
+            total.capacity_bytes += s.capacity_bytes;
+            shards.push_back({{"hits", s.hits}, {"misses", s.misses},
+                              {"evictions", s.evictions}, {"entries", s.entries},
+                              {"bytes", s.bytes}});
+        }
+        uint64_t lookups = total.hits + total.misses;
+        j["cache"] = {{"hits", total.hits}, {"misses", total.misses},
+                      {"evictions", total.evictions}, {"entries", total.entries},
+                      {"bytes", total.bytes}, {"capacity_bytes", total.capacity_bytes},
+                      {"hit_ratio", lookups ? (double)total.hits / lookups : 0.0},
+                      {"shards", shards}};
+        j["near_cache"] = near_cache->stats();
+        // near cache hits never reach the shared cache; its misses fall
+        // through and are counted there
+        uint64_t read_hits = j["near_cache"]["hits"].get<uint64_t>() + total.hits;
+        uint64_t reads = read_hits + total.misses;
+        j["reads"] = {{"hits", read_hits}, {"misses", total.misses},
+                      {"hit_ratio", reads ? (double)read_hits / reads : 0.0}};
+        j["negative_cache"] = {{"entries", negative_cache->size()},
+                               {"hits", negative_cache->hit_count()}};
+        j["single_flight"] = {{"inflight", inflight_reads->inflight()},
+                              {"coalesced", inflight_reads->coalesced_count()}};
+        j["ttl"] = {{"timers", expiry_wheel->size()}};
+        j["warmup"] = warmer->progress();
+        if (write_back) j["write_back"] = write_back->stats();
+        if (peer_invalidator) j["peer_invalidation"] = peer_invalidator->stats();
+        if (flash) j["flash"] = flash->stats();
+        j["db_pool"] = db_pool->stats();
+        if (db_pipeline) j["db_pipeline"] = db_pipeline->stats();
+        if (auto* c = dynamic_cast<CompressedCache*>(cache.get())) j["compression"] = c->stats();
+        return crow::response(200, j.dump());
     });
 
-    cout << "Server port no. =  8000 , using threads = " << threads << "\n";
+    cout << "Server port no. =  8000 , using threads = " << threads
+         << ", cache = " << opts.cache_engine
+         << ", cache shards = " << cache->shard_count() << "\n";
     app.loglevel(crow::LogLevel::Error);
     app.port(8000).concurrency(threads).run();
     return 0;
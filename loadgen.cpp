@@ -8,6 +8,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <random>
+#include "json.hpp"
 
 using namespace std;
 
@@ -33,7 +34,7 @@ string make_request(const string &method, const string &path,
 }
 
 
-bool read_http_response(int sock)
+bool read_http_response(int sock, string *body = nullptr)
 {
     char buf[8192];
     string header;
@@ -62,12 +63,16 @@ bool read_http_response(int sock)
 
             size_t need = (consumed >= content_len) ? 0 : (content_len - consumed);
 
+            if (body)
+                *body = header.substr(pos + 4);
 
             while (need > 0)
             {
                 ssize_t x = recv(sock, buf, min(sizeof(buf), need), 0);
                 if (x <= 0)
                     return false;
+                if (body)
+                    body->append(buf, buf + x);
                 need -= x;
             }
 
@@ -180,6 +185,45 @@ void client_thread(int id, int duration, const string &workload, int total_keys)
     close(sock);
 }
 
+// Server cache hit/miss counters from /metrics
+bool fetch_cache_counters(long long &hits, long long &misses)
+{
+    sockaddr_in serv{};
+    serv.sin_family = AF_INET;
+    serv.sin_port = htons(8000);
+    inet_pton(AF_INET, "127.0.0.1", &serv.sin_addr);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return false;
+    if (connect(sock, (sockaddr *)&serv, sizeof(serv)) < 0)
+    {
+        close(sock);
+        return false;
+    }
+
+    string req = make_request("GET", "/metrics");
+    string body;
+    bool ok = send(sock, req.c_str(), req.size(), 0) > 0 && read_http_response(sock, &body);
+    close(sock);
+    if (!ok)
+        return false;
+
+    try
+    {
+        auto j = nlohmann::json::parse(body);
+        // "reads" also counts near cache hits; older servers only report "cache"
+        auto& c = j.contains("reads") ? j["reads"] : j["cache"];
+        hits = c["hits"].get<long long>();
+        misses = c["misses"].get<long long>();
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
 // Main code
 int main(int argc, char *argv[])
 {
@@ -197,6 +241,9 @@ int main(int argc, char *argv[])
     cout << "Number of clients = " << num_clients << ", duration = "
          << duration << " seconds for workload: " << workload << endl;
 
+    long long hits0 = 0, misses0 = 0;
+    bool have_metrics = fetch_cache_counters(hits0, misses0);
+
     vector<thread> threads;
 
     for (int i = 0; i < num_clients; i++)
@@ -214,5 +261,13 @@ int main(int argc, char *argv[])
     cout << "Average Latency: " << avg_latency_ms << " ms\n";
     cout << "Throughput: " << throughput << " req/s\n";
 
+    long long hits1 = 0, misses1 = 0;
+    if (have_metrics && fetch_cache_counters(hits1, misses1))
+    {
+        long long lookups = (hits1 - hits0) + (misses1 - misses0);
+        cout << "Cache Hit Ratio: " << (lookups ? (double)(hits1 - hits0) / lookups : 0.0)
+             << " (" << lookups << " lookups)\n";
+    }
+
     return 0;
 }
\ No newline at end of file